@@ -43,10 +43,13 @@ migrate_test() {
     fi
 }
 
-NDIRECT=10
+NDIRECT=8
 NINDIRECT=2
 NDINDIRECT=1
+NTINDIRECT=1
+NPTRS_PER_BLOCK=128
 BSZ=512
+NBLOCKS=1024
 sparse_test() {
     touch input.tmp > out.tmp
     commands=(
@@ -80,7 +83,633 @@ sparse_test() {
     fi
 }
 
+# Past the doubly-indirect range, into the triply-indirect one
+triple_test() {
+    off=$(((NDIRECT+NINDIRECT*BSZ/4+NDINDIRECT*(BSZ/4)*(BSZ/4))*BSZ+1000))
+    touch input.tmp
+    commands=(
+        "touch /large"
+        "write /large $off 1 t"
+        "read /large $off 1"
+        "stat /large"
+        "quit"
+    )
+    doecho "${commands[@]}" > input.tmp
+    ./main vhd < input.tmp > out.tmp
+    size=$(awk -F: '$1 == "size" { print $2 }' out.tmp)
+    if [ "$(matchline 1 "t" out.tmp)" ] && [ "$size" -eq $((off+1)) ]; then
+        pass "triple: triply-indirect block mapped"
+    else
+        fail "triple: triply-indirect block not mapped"
+    fi
+}
+
+maxfile_test() {
+    max=$(((NDIRECT+NINDIRECT*BSZ/4+NDINDIRECT*(BSZ/4)*(BSZ/4)+NTINDIRECT*(BSZ/4)*(BSZ/4)*(BSZ/4))*BSZ))
+    touch input.tmp
+    # Past the largest mappable file, including offsets that wrap block numbers
+    doecho "touch /maxf" "write /maxf 0 5 hello" "write /maxf $((max-2)) 5 WORLD" "write /maxf $max 5 WORLD" \
+        "write /maxf 2199023255552 5 WORLD" "read /maxf 0 5" "stat /maxf" "rm /maxf" "quit" > input.tmp
+    ./main vhd < input.tmp > out.tmp 2> err.tmp
+    if [ "$(grep -c "myfs_write failed" err.tmp)" -eq 3 ] && grep -q "^hello$" out.tmp && \
+        [ "$(awk -F: '$1 == "size" { print $2 }' out.tmp)" = "5" ]; then
+        pass "maxfile: writes past the largest file rejected"
+    else
+        fail "maxfile: writes past the largest file accepted"
+    fi
+}
+
+ls_test() {
+    touch input.tmp > out.tmp
+    commands=(
+        "mkdir /dir"
+        "touch /dir/a"
+        "touch /dir/b"
+        "write /dir/b 0 3 abc"
+        "ls /dir"
+        "ls -l /dir"
+        "quit"
+    )
+    doecho "${commands[@]}" > input.tmp
+    ./main vhd < input.tmp > out.tmp
+    if [ "$(matchline 1 "a" out.tmp)" ] && \
+        [ "$(matchline 2 "b" out.tmp)" ]; then
+        pass "ls: entries listed"
+    else
+        fail "ls: entries missing"
+    fi
+    size=$(awk '$4 == "b" { print $3 }' out.tmp)
+    if [ "$size" = "3" ]; then
+        pass "ls: readdirplus size is 3"
+    else
+        fail "ls: readdirplus size is not 3"
+    fi
+}
+
+snapshot_test() {
+    touch input.tmp > out.tmp
+    commands=(
+        "touch /snap"
+        "write /snap 0 4 base"
+        "snapshot base"
+        "write /snap 0 4 next"
+        "touch /snapnew"
+        "read /snap 0 4"
+        "rollback base"
+        "read /snap 0 4"
+        "stat /snapnew"
+        "snapdel base"
+        "snapshots"
+        "quit"
+    )
+    doecho "${commands[@]}" > input.tmp
+    ./main vhd < input.tmp > out.tmp 2>/dev/null
+    if [ "$(matchline 1 "next" out.tmp)" ] && \
+        [ "$(matchline 2 "base" out.tmp)" ] && \
+        [ "$(wc -l < out.tmp)" -eq 2 ]; then
+        pass "snapshot: rollback restores the frozen tree"
+    else
+        fail "snapshot: rollback does not restore the frozen tree"
+    fi
+}
+
+clone_test() {
+    touch input.tmp > out.tmp
+    commands=(
+        "touch /orig"
+        "write /orig 6000 4 abcd"
+        "clone /copy /orig"
+        "write /copy 6000 4 XXXX"
+        "read /copy 6000 4"
+        "read /orig 6000 4"
+        "clone /fs.clone /fs.c"
+        "stat /fs.clone"
+        "quit"
+    )
+    doecho "${commands[@]}" > input.tmp
+    ./main vhd < input.tmp > out.tmp
+    size=$(awk -F: '$1 == "size" { print $2 }' out.tmp)
+    if [ "$(matchline 1 "XXXX" out.tmp)" ] && \
+        [ "$(matchline 2 "abcd" out.tmp)" ] && \
+        [ "$size" -eq "$(wc -c < fs.c)" ]; then
+        pass "clone: clone diverges from its source on write"
+    else
+        fail "clone: clone and source are not independent"
+    fi
+}
+
+compress_test() {
+    touch input.tmp
+    commands=(
+        "migrate -z /fs.z fs.c"
+        "write /fs.z 3000 4 ZZZZ"
+        "retrieve fs.z.tmp /fs.z"
+        "stat /fs.z"
+        "quit"
+    )
+    doecho "${commands[@]}" > input.tmp
+    ./main vhd < input.tmp > out.tmp
+    cp fs.c fs.c.tmp
+    printf 'ZZZZ' | dd of=fs.c.tmp bs=1 seek=3000 conv=notrunc 2>/dev/null
+    flags=$(awk -F: '$1 == "flags" { print $2 }' out.tmp)
+    if cmp -s fs.z.tmp fs.c.tmp && [ "$flags" = "1" ]; then
+        pass "compress: compressed file reads back intact"
+    else
+        fail "compress: compressed file differs"
+    fi
+}
+
+dedup_test() {
+    touch input.tmp
+    commands=(
+        "dedup on"
+        "migrate /dup1 fs.h"
+        "migrate /dup2 fs.h"
+        "retrieve dup1.tmp /dup1"
+        "dedup off"
+        "retrieve fs.h.tmp /dup2"
+        "quit"
+    )
+    doecho "${commands[@]}" > input.tmp
+    ./main vhd < input.tmp > out.tmp
+    deduped=$(awk -F: '$1 == "deduped" { print $2 }' out.tmp)
+    # Reads while deduplicating must leave the blocks alone
+    if cmp -s fs.h.tmp fs.h && cmp -s dup1.tmp fs.h && [ "$deduped" -eq $(($(wc -c < fs.h) / BSZ)) ]; then
+        pass "dedup: identical blocks shared"
+    else
+        fail "dedup: identical blocks not shared"
+    fi
+}
+
+delalloc_test() {
+    touch input.tmp
+    doecho "touch /tmpf" "touch /da" "touch /db" "quit" > input.tmp
+    ./main vhd < input.tmp > out.tmp
+    # Interleaved appends to two files, and a file deleted before it is flushed
+    commands=(
+        "write /tmpf 0 4 abcd"
+        "rm /tmpf"
+    )
+    for i in 0 1 2 3 4; do
+        commands+=("write /da $((i*BSZ)) 1 a" "write /db $((i*BSZ)) 1 b")
+    done
+    commands+=("read /da $((4*BSZ)) 1" "defrag" "quit")
+    doecho "${commands[@]}" > input.tmp
+    ./main vhd < input.tmp > out.tmp
+    # One directory block for the unlink and five blocks per file, none for /tmpf
+    writes=$(grep -c "write block" log)
+    frags=$(grep -c ": 5 blocks, 1 -> 1 fragments" out.tmp)
+    if [ "$writes" -eq 11 ] && [ "$frags" -eq 2 ] && grep -q "^a" out.tmp; then
+        pass "delalloc: appends allocated contiguously"
+    else
+        fail "delalloc: appends not allocated contiguously"
+    fi
+}
+
+goal_test() {
+    head -c $((NBLOCKS*BSZ)) /dev/zero > goal.tmp
+    head -c $(((NDIRECT+12)*BSZ)) fs.c > gf.tmp
+    # A hole ahead of the directory, big enough for the file: first-fit would use it
+    doecho "migrate /h file.c" "sync" "mkdir /g" "touch /g/e" "rm /h" "migrate /g/f gf.tmp" "quit" > input.tmp
+    ./main goal.tmp < input.tmp > out.tmp
+    doecho "retrieve back.tmp /g/f" "quit" > input.tmp
+    ./main goal.tmp < input.tmp > out.tmp
+    # The directory block of /g, then the data blocks of /g/f in file order
+    blocks=($(awk -F': ' '$1 == "read block" { print $2 }' log | tail -n $((NDIRECT+13))))
+    ok=1
+    for i in $(seq 1 $((NDIRECT+12))); do
+        # One block ahead of each, and two ahead of the first past the
+        # direct ones: the indirect block mapping it sits in between
+        step=$([ $i -eq $((NDIRECT+1)) ] && echo 2 || echo 1)
+        [ "${blocks[$i]}" -eq $((blocks[i-1]+step)) ] || ok=0
+    done
+    ind=$((blocks[NDIRECT]+1))
+    first=$(od -An -tu4 -N4 -j $((ind*BSZ)) goal.tmp | tr -d ' ')
+    if [ $ok -eq 1 ] && [ "$first" = "${blocks[NDIRECT+1]}" ] && cmp -s back.tmp gf.tmp; then
+        pass "goal: file laid out right after its directory, indirect block ahead of its data"
+    else
+        fail "goal: file not laid out sequentially"
+    fi
+}
+
+enospc_test() {
+    # More than the data blocks of a fresh image hold
+    head -c $((1024*BSZ)) /dev/zero > full.tmp
+    head -c 600000 /dev/urandom > big.tmp
+    doecho "migrate /big big.tmp" "sync" "quit" > input.tmp
+    ./main full.tmp < input.tmp > out.tmp 2> err.tmp
+    doecho "retrieve back.tmp /big" "quit" > input.tmp
+    ./main full.tmp < input.tmp > out.tmp
+    # The write fails, and whatever it reported as written reads back intact
+    size=$(stat -c %s back.tmp)
+    if grep -q "myfs_write failed" err.tmp && [ "$size" -gt 0 ] && [ "$size" -lt 600000 ] && \
+        cmp -s back.tmp <(head -c "$size" big.tmp) && ! grep -q "flush of inode" log; then
+        pass "enospc: full disk fails the write"
+    else
+        fail "enospc: full disk loses data"
+    fi
+    # /b, written through once the cache is full, must not take the blocks
+    # held back for the pages of /a. The flusher is kept out of the way.
+    head -c $((NBLOCKS*BSZ)) /dev/zero > full.tmp
+    head -c $((730*BSZ)) /dev/urandom > c.tmp
+    head -c $((60*BSZ)) /dev/urandom > a.tmp
+    head -c $((100*BSZ)) /dev/urandom > b.tmp
+    doecho "writeback 1000000 200" "migrate /c c.tmp" "sync" "migrate /a a.tmp" "migrate /b b.tmp" "sync" \
+        "quit" > input.tmp
+    ./main full.tmp < input.tmp > out.tmp 2> err.tmp
+    doecho "retrieve back.tmp /a" "quit" > input.tmp
+    ./main full.tmp < input.tmp > out.tmp
+    if grep -q "myfs_write failed, /b" err.tmp && ! grep -q "sync failed" err.tmp && cmp -s back.tmp a.tmp; then
+        pass "enospc: held blocks left to the pages they were held for"
+    else
+        fail "enospc: written-through blocks taken from dirty pages"
+    fi
+}
+
+fd_test() {
+    touch input.tmp
+    # Writes through a descriptor and its dup append after each other, and
+    # pwrite leaves the offset where it was
+    commands=(
+        "touch /fdf" "open /fdf" "dup 0" "fdwrite 0 abc" "fdwrite 1 def" "fdpwrite 0 0 XY" "fdwrite 1 gh"
+    )
+    # So do reads, and pread
+    commands+=("open /fdf" "dup 2" "fdread 2 3" "fdpread 3 0 2" "fdread 3 3")
+    commands+=("close 0" "close 1" "close 2" "close 3" "read /fdf 0 20" "rm /fdf" "quit")
+    doecho "${commands[@]}" > input.tmp
+    ./main vhd < input.tmp > out.tmp 2> err.tmp
+    if [ "$(tr '\n' ' ' < out.tmp)" = "fd:0 fd:1 fd:2 fd:3 XYc XY def XYcdefgh " ] && [ ! -s err.tmp ]; then
+        pass "fd: dup shares the offset, pread and pwrite leave it alone"
+    else
+        fail "fd: offsets not shared or moved by pread/pwrite"
+    fi
+}
+
+defrag_test() {
+    touch input.tmp
+    # A fresh image, so that every file can end up in one piece
+    head -c $((NBLOCKS*BSZ)) /dev/zero > defrag.tmp
+    # More blocks than the image has, all the same: deduplicated against itself
+    head -c $((1500*BSZ)) /dev/zero | tr '\0' 'z' > same.tmp
+    commands=(
+        "dedup on"
+        "migrate /same same.tmp"
+        "dedup off"
+        "migrate /frag1 fs.h"
+        "sync"
+        "migrate /frag2 file.c"
+        "sync"
+        "write /frag1 9000 3 xyz"
+        "sync"
+        "defrag -p"
+        "retrieve frag1.tmp /frag1"
+        "retrieve frag2.tmp /frag2"
+        "retrieve same2.tmp /same"
+        "quit"
+    )
+    doecho "${commands[@]}" > input.tmp
+    ./main defrag.tmp < input.tmp > out.tmp
+    cp fs.h exp1.tmp
+    truncate -s 9000 exp1.tmp
+    printf xyz >> exp1.tmp
+    before=$(awk -F: '$1 == "before" { print $2 }' out.tmp)
+    after=$(awk -F: '$1 == "after" { print $2 }' out.tmp)
+    # /frag1, appended to past /frag2, was in two pieces
+    split=$(grep -c " 2 -> 1 fragments" out.tmp)
+    left=$(grep "fragments" out.tmp | grep -vc " -> 1 fragments")
+    # The shared blocks of /same keep it out
+    if cmp -s frag1.tmp exp1.tmp && cmp -s frag2.tmp file.c && cmp -s same2.tmp same.tmp && [ "$after" -lt "$before" ] && \
+        [ "$split" -eq 1 ] && [ "$left" -eq 0 ]; then
+        pass "defrag: fragments reduced from $before to $after, one per file"
+    else
+        fail "defrag: fragments not reduced"
+    fi
+}
+
+df_test() {
+    touch input.tmp
+    doecho "touch /dff" "df" "write /dff 0 3 abc" "write /dff $((2*BSZ)) 3 abc" "sync" "df" "quit" > input.tmp
+    ./main vhd < input.tmp > out.tmp
+    free0=$(awk -F: '$1 == "free" { print $2; exit }' out.tmp)
+    reg0=$(awk -F: '$1 == "reg" { print $2; exit }' out.tmp)
+    free1=$(awk -F: '$1 == "free" { n = $2 } END { print n }' out.tmp)
+    reg1=$(awk -F: '$1 == "reg" { n = $2 } END { print n }' out.tmp)
+    # Removing the file gives back its blocks and inode, as seen after a remount
+    doecho "rm /dff" "quit" > input.tmp
+    ./main vhd < input.tmp > out.tmp
+    doecho "df" "quit" > input.tmp
+    ./main vhd < input.tmp > out.tmp
+    if [ "$free1" -eq $((free0-2)) ] && [ "$reg1" -eq "$reg0" ] && \
+        [ "$(awk -F: '$1 == "free" { print $2 }' out.tmp)" = "$free0" ] && \
+        [ "$(awk -F: '$1 == "reg" { print $2 }' out.tmp)" = $((reg0-1)) ]; then
+        pass "df: usage counters follow allocations"
+    else
+        fail "df: usage counters wrong"
+    fi
+}
+
+cbt_test() {
+    touch input.tmp
+    cp vhd base.tmp
+    doecho "gen" "quit" > input.tmp
+    ./main vhd < input.tmp > out.tmp
+    gen=$(awk -F: '$1 == "gen" { print $2 }' out.tmp)
+    doecho "migrate /cbt fs.h" "export delta.tmp $gen" "quit" > input.tmp
+    ./main vhd < input.tmp > out.tmp
+    exported=$(awk -F: '$1 == "exported" { print $2 }' out.tmp)
+    doecho "apply base.tmp delta.tmp" "quit" > input.tmp
+    ./main vhd < input.tmp > out.tmp
+    applied=$(awk -F: '$1 == "applied" { print $2 }' out.tmp)
+    # The copy taken before the two sessions now has the file
+    doecho "retrieve cbt.tmp /cbt" "quit" > input.tmp
+    ./main base.tmp < input.tmp > out.tmp
+    if cmp -s cbt.tmp fs.h && [ "$applied" = "$exported" ] && [ "$exported" -lt $((NBLOCKS/8)) ] && \
+        ! grep -q "rebuilt" log; then
+        pass "cbt: copy updated with $exported changed blocks"
+    else
+        fail "cbt: copy not updated"
+    fi
+}
+
+contig_test() {
+    touch input.tmp
+    doecho "migrate -c /boot file.c" "extent /boot" "retrieve boot.tmp /boot" "quit" > input.tmp
+    ./main vhd < input.tmp > out.tmp
+    start=$(awk -F: '$1 == "start" { print $2 }' out.tmp)
+    len=$(awk -F: '$1 == "len" { print $2 }' out.tmp)
+    size=$(stat -c %s file.c)
+    # One read of the run: the direct blocks, the indirect block, then the rest
+    dd if=vhd bs=$BSZ skip=$start count=$len 2>/dev/null > run.tmp
+    { head -c $((NDIRECT*BSZ)) run.tmp; tail -c +$(((NDIRECT+1)*BSZ+1)) run.tmp; } | head -c $size > raw.tmp
+    if cmp -s boot.tmp file.c && cmp -s raw.tmp file.c && [ "$len" -eq $(((size+BSZ-1)/BSZ+1)) ]; then
+        pass "contig: file laid out in one run of $len blocks"
+    else
+        fail "contig: file not laid out in one run"
+    fi
+}
+
+rdonly_test() {
+    touch input.tmp
+    sum=$(md5sum < vhd)
+    doecho "retrieve ro.tmp /fs.c" "touch /ro" "quit" > input.tmp
+    ./main -r vhd < input.tmp > out.tmp 2> err.tmp
+    # Several processes sharing the mapped image
+    doecho "retrieve ro1.tmp /fs.c" "quit" > input1.tmp
+    doecho "retrieve ro2.tmp /fs.c" "quit" > input2.tmp
+    doecho "retrieve ro3.tmp /fs.c" "quit" > input3.tmp
+    for i in 1 2 3; do
+        ./main -r vhd < input$i.tmp > /dev/null &
+    done
+    wait
+    if cmp -s ro.tmp fs.c && cmp -s ro1.tmp fs.c && cmp -s ro2.tmp fs.c && cmp -s ro3.tmp fs.c && \
+        grep -q "myfs_mknod failed" err.tmp && [ "$(md5sum < vhd)" = "$sum" ]; then
+        pass "rdonly: image read and left untouched"
+    else
+        fail "rdonly: image not read or modified"
+    fi
+}
+
+direct_test() {
+    touch input.tmp
+    doecho "direct on" "migrate /direct fs.c" "retrieve direct.tmp /direct" "direct off" "rm /direct" "quit" > input.tmp
+    ./main vhd < input.tmp > out.tmp 2> err.tmp
+    if grep -q "not available" err.tmp; then
+        pass "direct: not available on this host, skipped"
+    elif cmp -s direct.tmp fs.c && grep -q "direct write" log && grep -q "direct read" log; then
+        pass "direct: file copied in and out around the caches"
+    else
+        fail "direct: file not copied directly"
+    fi
+}
+
+writeback_test() {
+    # Commands fed one at a time, giving the flusher time to run in between
+    { echo "writeback 100 100"; echo "migrate /wb1 fs.h"; sleep 1
+      echo "writeback 60000 25"; echo "migrate /wb2 file.c"; sleep 1
+      echo "fsync /wb2"; echo "retrieve wb1.tmp /wb1"; echo "retrieve wb2.tmp /wb2"
+      echo "rm /wb1"; echo "rm /wb2"; echo "quit"; } |
+        ./main vhd > out.tmp 2> err.tmp
+    # Only the writeback command runs, not write as well
+    if cmp -s wb1.tmp fs.h && cmp -s wb2.tmp file.c && ! grep -q "failed" err.tmp && ! grep -q "^write:" out.tmp && \
+        grep -q "writeback: .*(age)" log && grep -q "writeback: .*(ratio)" log; then
+        pass "writeback: old and excess pages flushed in the background"
+    else
+        fail "writeback: pages not flushed in the background"
+    fi
+}
+
+wberr_test() {
+    head -c $((NBLOCKS*BSZ)) /dev/zero > full.tmp
+    head -c $((780*BSZ)) /dev/urandom > c.tmp
+    doecho "migrate -c /c c.tmp" "df" "quit" > input.tmp
+    ./main full.tmp < input.tmp > out.tmp
+    # Leave 16 blocks free, with the filler's indirect block
+    fill=$(($(awk -F: '$1 == "free" { print $2 }' out.tmp) - 16 - 1))
+    head -c $((fill*BSZ)) /dev/urandom > f.tmp
+    # Ten pages one per indirect block hold back 13 blocks, but their flush
+    # takes 21, so that it fails in the background. The next fsync reports it
+    # even though the pages are written once /f is gone, and the one after
+    # that succeeds.
+    writes=()
+    for i in $(seq 0 9); do
+        writes+=("write /a $(((NDIRECT+NPTRS_PER_BLOCK*(i+1))*BSZ)) 1 x$i")
+    done
+    { echo "writeback 60000 200"; echo "migrate /f f.tmp"; echo "sync"; echo "touch /a"
+      doecho "${writes[@]}"; echo "writeback 100 100"; sleep 1
+      echo "rm /f"; echo "fsync /a"; echo "fsync /a"
+      echo "read /a $(((NDIRECT+NPTRS_PER_BLOCK)*BSZ)) 2"; echo "read /a $(((NDIRECT+NPTRS_PER_BLOCK*10)*BSZ)) 2"
+      echo "quit"; } | ./main full.tmp > out.tmp 2> err.tmp
+    if [ "$(grep -c "fsync of /a failed" err.tmp)" = "1" ] && grep -q "flush of inode" log && \
+        grep -q "^x0$" out.tmp && grep -q "^x9$" out.tmp; then
+        pass "wberr: background flush failure reported by fsync"
+    else
+        fail "wberr: background flush failure lost"
+    fi
+}
+
+replay_test() {
+    touch input.tmp
+    doecho "record trace.tmp" "mkdir /tr" "migrate /tr/a fs.c" "migrate /tr/b fs.h" "retrieve tr.tmp /tr/a" \
+        "rm /tr/b" "record off" "rm /tr/a" "rm /tr" "quit" > input.tmp
+    ./main vhd < input.tmp > out.tmp
+    # Against a fresh image, the same calls succeed and leave the same tree
+    dd if=/dev/zero of=fresh.tmp bs=$BSZ count=$NBLOCKS 2>/dev/null
+    doecho "replay trace.tmp" "ls /tr" "stat /tr/a" "quit" > input.tmp
+    ./main fresh.tmp < input.tmp > out.tmp
+    ops=$(awk -F: '$1 == "replay" { print $2 }' out.tmp)
+    if [ "$(awk -F: '$1 == "diverged" { print $2 }' out.tmp)" = "0" ] && [ "$ops" -gt 0 ] && \
+        grep -q "^write:" out.tmp && ! grep -q "^b$" out.tmp && \
+        [ "$(awk -F: '$1 == "size" { print $2 }' out.tmp)" = "$(stat -c %s fs.c)" ]; then
+        pass "replay: $ops recorded calls replayed on a fresh image"
+    else
+        fail "replay: trace not replayed"
+    fi
+}
+
+bmcache_test() {
+    touch input.tmp
+    # Blocks 0, 200 and 201: direct, then doubly indirect
+    doecho "touch /bm" "write /bm 0 5 first" "write /bm $((200*BSZ)) 5 hello" "write /bm $((201*BSZ)) 5 world" \
+        "sync" "read /bm $((200*BSZ)) 5" "iostat" "read /bm 0 5" "iostat" "read /bm $((201*BSZ)) 5" "iostat" \
+        "rm /bm" "quit" > input.tmp
+    ./main vhd < input.tmp > out.tmp
+    set -- $(awk -F: '$1 == "blocks read" { print $2 }' out.tmp)
+    # Once its indirect block has been walked, a block costs what a direct one does
+    if grep -q "^world$" out.tmp && [ $(($3 - $2)) -eq $(($2 - $1)) ]; then
+        pass "bmcache: mapped block read without walking the block map"
+    else
+        fail "bmcache: block map walked again"
+    fi
+}
+
+pipeline_test() {
+    touch input.tmp
+    rm -rf imp.dir exp.dir
+    mkdir -p imp.dir/sub/deep imp.dir/emptyd
+    cp fs.h lz.c imp.dir
+    cp crc32c.c types.h imp.dir/sub
+    cp lz.h imp.dir/sub/deep
+    : > imp.dir/sub/empty
+    doecho "import /imp imp.dir 4" "extract exp.dir /imp 4" "rm /imp/fs.h" "rm /imp/lz.c" \
+        "rm /imp/sub/crc32c.c" "rm /imp/sub/types.h" "rm /imp/sub/empty" "rm /imp/sub/deep/lz.h" \
+        "rm /imp/sub/deep" "rm /imp/sub" "rm /imp/emptyd" "rm /imp" "quit" > input.tmp
+    ./main vhd < input.tmp > out.tmp
+    if diff -r imp.dir exp.dir > /dev/null && [ "$(awk -F: '$1 == "errors" { print $2 }' out.tmp | sort -u)" = "0" ] && \
+        [ "$(awk -F: '$1 == "imported" { print $2 }' out.tmp)" = "6" ] && grep -q "^write:4 threads" out.tmp; then
+        pass "pipeline: tree imported and extracted intact"
+    else
+        fail "pipeline: tree not copied intact"
+    fi
+    rm -rf imp.dir exp.dir
+}
+
+nested_test() {
+    touch input.tmp
+    rm -rf nest.dir exp.dir
+    # Deep enough that the readers would hand files to the meta stage before
+    # their directory, and short enough for the rm commands
+    d=nest.dir
+    p=/n
+    rm_cmds=()
+    for i in a b c d e f g h i j; do
+        d=$d/$i
+        p=$p/$i
+        mkdir -p $d
+        for f in $(seq 1 12); do
+            head -c $((f*BSZ/12)) fs.h > $d/$f
+            rm_cmds=("rm $p/$f" "${rm_cmds[@]}")
+        done
+        rm_cmds=("${rm_cmds[@]:0:12}" "rm $p" "${rm_cmds[@]:12}")
+    done
+    doecho "import /n nest.dir 8" "extract exp.dir /n 8" "${rm_cmds[@]}" "rm /n" "ls /" "quit" > input.tmp
+    ./main vhd < input.tmp > out.tmp 2> err.tmp
+    if diff -r nest.dir exp.dir > /dev/null && [ "$(awk -F: '$1 == "errors" { print $2 }' out.tmp | sort -u)" = "0" ] && \
+        [ "$(awk -F: '$1 == "imported" { print $2 }' out.tmp)" = "120" ] && [ ! -s err.tmp ]; then
+        pass "nested: deep tree imported with 8 threads"
+    else
+        fail "nested: deep tree not imported intact"
+    fi
+    rm -rf nest.dir exp.dir
+}
+
+stress_test() {
+    touch input.tmp
+    doecho "stress 4 100" "quit" > input.tmp
+    ./main vhd < input.tmp > out.tmp
+    if [ "$(awk -F: '$1 == "stress" { print $2 }' out.tmp)" = "0" ]; then
+        pass "stress: concurrent readers and writers agree"
+    else
+        fail "stress: concurrent readers and writers disagree"
+    fi
+}
+
+format_test() {
+    # An image full of garbage: formatting must not depend on it being zeroed
+    head -c $((1024*BSZ)) /dev/urandom > garbage.tmp
+    doecho "mkdir /d" "touch /d/f" "write /d/f 0 3 abc" "quit" > input.tmp
+    ./main garbage.tmp < input.tmp > out.tmp
+    doecho "ls /d" "read /d/f 0 3" "quit" > input.tmp
+    ./main garbage.tmp < input.tmp > out.tmp
+    # Only the first inode block has been written
+    itinit=$(awk -F: '$1 == "itable_init" { print $2 }' log)
+    if [ "$(tr '\n' ' ' < out.tmp)" = "f abc " ] && [ "$itinit" = "1" ]; then
+        pass "format: garbage image formatted lazily"
+    else
+        fail "format: garbage image not formatted"
+    fi
+}
+
+# Must run last on vhd: it corrupts the image
+scrub_test() {
+    touch input.tmp
+    doecho "scrub" "quit" > input.tmp
+    ./main vhd < input.tmp > out.tmp
+    bad=$(awk -F: '$1 == "bad" { print $2 }' out.tmp)
+    checked=$(awk -F: '$1 == "checked" { print $2 }' out.tmp)
+    # Flip a byte in the first inode block
+    printf 'X' | dd of=vhd bs=1 seek=$((95*BSZ+100)) conv=notrunc 2>/dev/null
+    ./main vhd < input.tmp > out.tmp
+    if [ "$bad" = "0" ] && [ "$checked" -gt 0 ] && \
+        [ "$(awk -F: '$1 == "bad" { print $2 }' out.tmp)" = "1" ]; then
+        pass "scrub: corruption detected"
+    else
+        fail "scrub: corruption not detected"
+    fi
+}
+
 migrate_test
 cleanup
 sparse_test
 cleanup
+triple_test
+cleanup
+maxfile_test
+cleanup
+ls_test
+cleanup
+fd_test
+cleanup
+snapshot_test
+cleanup
+clone_test
+cleanup
+compress_test
+cleanup
+dedup_test
+cleanup
+delalloc_test
+cleanup
+goal_test
+cleanup
+enospc_test
+cleanup
+defrag_test
+cleanup
+df_test
+cleanup
+cbt_test
+cleanup
+contig_test
+cleanup
+rdonly_test
+cleanup
+direct_test
+cleanup
+writeback_test
+cleanup
+wberr_test
+cleanup
+replay_test
+cleanup
+bmcache_test
+cleanup
+pipeline_test
+cleanup
+nested_test
+cleanup
+stress_test
+cleanup
+scrub_test
+cleanup
+format_test
+cleanup
@@ -0,0 +1,123 @@
+/**
+ * @file crc32c.c
+ * @brief CRC32C (Castagnoli) checksums for disk blocks
+ *
+ * Uses the CRC32 instructions of SSE4.2 (x86-64) or ARMv8 when the CPU has
+ * them, and a slicing-by-8 table otherwise. The implementation is picked on
+ * the first call, once, however many threads make it at the same time.
+ */
+
+#include "crc32c.h"
+
+#include <pthread.h>
+#include <string.h>
+
+#define CRC32C_POLY 0x82f63b78 // reversed Castagnoli polynomial
+
+static u32 table[8][256];
+
+static void make_table()
+{
+    for (u32 i = 0; i < 256; i++) {
+        u32 crc = i;
+        for (int k = 0; k < 8; k++)
+            crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+        table[0][i] = crc;
+    }
+    for (u32 i = 0; i < 256; i++)
+        for (int t = 1; t < 8; t++)
+            table[t][i] = (table[t-1][i] >> 8) ^ table[0][table[t-1][i] & 0xff];
+}
+
+// Slicing-by-8: fold eight bytes per step through eight tables
+static u32 crc32c_sw(u32 crc, const u8 *p, u32 n)
+{
+    for (; n >= 8; n -= 8, p += 8) {
+        u32 lo, hi;
+        memcpy(&lo, p, 4);
+        memcpy(&hi, p + 4, 4);
+        lo ^= crc;
+        crc = table[7][lo & 0xff] ^ table[6][(lo >> 8) & 0xff] ^
+              table[5][(lo >> 16) & 0xff] ^ table[4][lo >> 24] ^
+              table[3][hi & 0xff] ^ table[2][(hi >> 8) & 0xff] ^
+              table[1][(hi >> 16) & 0xff] ^ table[0][hi >> 24];
+    }
+    for (; n; n--)
+        crc = (crc >> 8) ^ table[0][(crc ^ *p++) & 0xff];
+    return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static u32 crc32c_hw(u32 crc, const u8 *p, u32 n)
+{
+    u64 c = crc;
+    for (; n >= 8; n -= 8, p += 8) {
+        u64 v;
+        memcpy(&v, p, 8);
+        c = __builtin_ia32_crc32di(c, v);
+    }
+    crc = c;
+    for (; n; n--)
+        crc = __builtin_ia32_crc32qi(crc, *p++);
+    return crc;
+}
+
+static int have_hw()
+{
+    return __builtin_cpu_supports("sse4.2");
+}
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+
+static u32 crc32c_hw(u32 crc, const u8 *p, u32 n)
+{
+    for (; n >= 8; n -= 8, p += 8) {
+        u64 v;
+        memcpy(&v, p, 8);
+        crc = __crc32cd(crc, v);
+    }
+    for (; n; n--)
+        crc = __crc32cb(crc, *p++);
+    return crc;
+}
+
+static int have_hw()
+{
+    return 1;
+}
+#else
+#define crc32c_hw crc32c_sw
+
+static int have_hw()
+{
+    return 0;
+}
+#endif
+
+static u32 (*crc32c_impl)(u32 crc, const u8 *p, u32 n);
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+static void crc32c_init()
+{
+    if (have_hw())
+        crc32c_impl = crc32c_hw;
+    else {
+        make_table();
+        crc32c_impl = crc32c_sw;
+    }
+}
+
+/**
+ * @brief Extend a CRC32C over a buffer
+ * 
+ * @param crc The CRC of the preceding data, 0 to start a new one.
+ * @param buf The data.
+ * @param n The size of the data.
+ * @return u32 The CRC of the preceding data followed by 'buf'.
+ */
+u32 crc32c(u32 crc, const void *buf, u32 n)
+{
+    pthread_once(&crc32c_once, crc32c_init);
+    return ~crc32c_impl(~crc, buf, n);
+}
@@ -0,0 +1,8 @@
+/**
+ * @file crc32c.h
+ * @brief CRC32C (Castagnoli) checksums for disk blocks
+ */
+
+#include "types.h"
+
+u32 crc32c(u32 crc, const void *buf, u32 n);
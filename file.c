@@ -6,23 +6,142 @@
 
 #include <stdio.h>
 #include <fcntl.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
 #include <assert.h>
+#include <pthread.h>
+#include <time.h>
 
 #define MAXPATH 64
-#define NFILES 100
+#define NFILES 64 // initial size of the descriptor table
 
-// opened file table
-static struct ofile opened[NFILES];
+// Per-file-system state of the file layer, kept in the fs_files() slot.
+//
+// Descriptor table. Each descriptor points to an open file, which several
+// descriptors share after myfs_dup(). Free descriptors are chained through
+// fdnext so that allocating one is O(1); the table doubles when it runs out.
+// All of it, and the offsets of the open files, are guarded by fdlock. A
+// descriptor must not be closed while another thread is using it.
+struct files {
+    struct ofile **fdtab;
+    int *fdnext;
+    int nfds;
+    int fdfree;
+    pthread_mutex_t fdlock;
+    pthread_mutex_t nslock;     // Serializes the calls that add or remove directory entries
+    FILE *trace;                // Where the calls are recorded, NULL if they are not (see myfs_trace())
+    u64 tstart;                 // When the trace began, in ns
+    pthread_mutex_t tlock;      // Guards the trace
+};
+
+// Set up the file layer on a file system just mounted
+static struct FileSystem *files_init(struct FileSystem *fs) {
+    struct files *ft = calloc(1, sizeof *ft);
+    if (!fs || !ft) {
+        if (fs)
+            fs_exit(fs);
+        free(ft);
+        return 0;
+    }
+    ft->fdfree = -1;
+    pthread_mutex_init(&ft->fdlock, 0);
+    pthread_mutex_init(&ft->nslock, 0);
+    pthread_mutex_init(&ft->tlock, 0);
+    *fs_files(fs) = ft;
+    return fs;
+}
+
+/**
+ * @brief Mount an image (see fs_init()) and set up the file layer on it
+ * 
+ * @return struct FileSystem* The handle for the myfs_*() calls, or NULL on failure
+ */
+struct FileSystem *myfs_mount(const char *vhd, const char *log) {
+    return files_init(fs_init(vhd, log));
+}
+
+/**
+ * @brief Mount an image read-only (see fs_init_rdonly())
+ * 
+ * Files can only be opened O_RDONLY, and the calls that add or remove
+ * directory entries fail. Descriptors still go through the descriptor
+ * table and its lock; reads and lookups take no other lock.
+ * 
+ * @return struct FileSystem* The handle for the myfs_*() calls, or NULL on failure
+ */
+struct FileSystem *myfs_mount_rdonly(const char *vhd, const char *log) {
+    return files_init(fs_init_rdonly(vhd, log));
+}
+
+/**
+ * @brief Close whatever is still open and unmount (see fs_exit())
+ */
+void myfs_unmount(struct FileSystem *fs) {
+    struct files *ft = *fs_files(fs);
+    for (int fd = 0; fd < ft->nfds; fd++)
+        if (ft->fdtab[fd] && !--ft->fdtab[fd]->refcnt)
+            free(ft->fdtab[fd]);
+    free(ft->fdtab);
+    free(ft->fdnext);
+    if (ft->trace)
+        fclose(ft->trace);
+    pthread_mutex_destroy(&ft->fdlock);
+    pthread_mutex_destroy(&ft->nslock);
+    pthread_mutex_destroy(&ft->tlock);
+    free(ft);
+    *fs_files(fs) = 0;
+    fs_exit(fs);
+}
+
+// Return the open file behind 'fd', or NULL if 'fd' is not open
+static struct ofile *fdget(struct FileSystem *fs, int fd)
+{
+    struct files *ft = *fs_files(fs);
+    pthread_mutex_lock(&ft->fdlock);
+    struct ofile *f = fd >= 0 && fd < ft->nfds ? ft->fdtab[fd] : 0;
+    pthread_mutex_unlock(&ft->fdlock);
+    if (!f)
+        fprintf(stderr, "invalid fd\n");
+    return f;
+}
+
+// Bind a free descriptor to 'f'. Return the descriptor, or -1 if out of memory.
+// The caller holds fdlock.
+static int fdalloc(struct FileSystem *fs, struct ofile *f)
+{
+    struct files *ft = *fs_files(fs);
+    if (ft->fdfree < 0) {
+        int n = ft->nfds ? ft->nfds * 2 : NFILES;
+        struct ofile **t = realloc(ft->fdtab, n * sizeof *t);
+        if (!t)
+            return -1;
+        ft->fdtab = t;
+        int *next = realloc(ft->fdnext, n * sizeof *next);
+        if (!next)
+            return -1;
+        ft->fdnext = next;
+        for (int i = n - 1; i >= ft->nfds; i--) {
+            ft->fdtab[i] = 0;
+            ft->fdnext[i] = ft->fdfree;
+            ft->fdfree = i;
+        }
+        ft->nfds = n;
+    }
+    int fd = ft->fdfree;
+    ft->fdfree = ft->fdnext[fd];
+    ft->fdtab[fd] = f;
+    f->refcnt++;
+    return fd;
+}
 
 // Look up 'name' under the directory pointed to by 'inum.'
 // Return the *index* of the dirent containing 'name' if found and -1 otherwise.
 // Write the offset of the dirent found into *poff if it's not NULL.
-static u32 dir_lookup(u32 inum, char *name, u32 *poff)
+static u32 dir_lookup(struct FileSystem *fs, u32 inum, char *name, u32 *poff)
 {
     struct dinode di;
-    read_inode(inum, &di);
+    read_inode(fs, inum, &di);
     // Not a directory
     if (di.type != T_DIR)
         return NULLINUM;
@@ -30,7 +149,7 @@ static u32 dir_lookup(u32 inum, char *name, u32 *poff)
     for (int i = 0; i < di.size / sizeof(struct dirent); 
         i++, off += sizeof(struct dirent)) {
         struct dirent de;
-        inode_read(inum, &de, sizeof(struct dirent), off);
+        inode_read(fs, inum, &de, sizeof(struct dirent), off);
         if (!strcmp(name, de.name)) {
             if (poff)
                 *poff = off;
@@ -42,7 +161,7 @@ static u32 dir_lookup(u32 inum, char *name, u32 *poff)
 
 // Find the inode corresponds to the given path.
 // If parent = 1, stop one level early at the parent dir.
-u32 lookup(char *path, int parent) {
+u32 lookup(struct FileSystem *fs, char *path, int parent) {
     if (!path)
         return NULLINUM;
     int l = strnlen(path, MAXPATH);
@@ -71,7 +190,7 @@ u32 lookup(char *path, int parent) {
         // stop one level early to return the inode of the parent dir
         if (!*path && parent)
             break;
-        if (!(inum = dir_lookup(inum, name, 0)))
+        if (!(inum = dir_lookup(fs, inum, name, 0)))
             return NULLINUM;
     }
     return inum;
@@ -109,7 +228,7 @@ char *getname(char *path, char *name, char *parent) {
 
 // path = parent(dir)/name
 // Create an inode and link it under "parent" with "name"
-int myfs_mknod(char *path, u16 type) {
+static int mknod_locked(struct FileSystem *fs, char *path, u16 type) {
     u32 n;
     char parent[MAXPATH];
     char name[MAXNAME];
@@ -120,77 +239,135 @@ int myfs_mknod(char *path, u16 type) {
         return -1;
     }
     // Parent path must points to a valid *directory* inode.
-    n = lookup(path, 1);
+    n = lookup(fs, path, 1);
     if (n == NULLINUM) {
         fprintf(stderr, "parent directory not found %s\n", parent);
         return -1;
     }
-    read_inode(n, &di);
+    read_inode(fs, n, &di);
     if (di.type != T_DIR) {
         fprintf(stderr, "not a directory %s\n", parent);
         return -1;
     }
     // Check for duplicates
-    if (dir_lookup(n, name, 0)) {
+    if (dir_lookup(fs, n, name, 0)) {
         fprintf(stderr, "%s found under %s\n", name, parent);
         return -1;
     }
     // Create an inode.
-    de.inum = alloc_inode(type);
+    de.inum = alloc_inode(fs, type);
     if (de.inum == NULLINUM) {
         fprintf(stderr, "failed to allocate inode\n");
         return -1;
     }
+    // Place its data close to the parent's
+    inode_hint(fs, de.inum, n);
     // Link it to the "parent" dir.
     strncpy(de.name, name, MAXNAME);
-    if (inode_write(n, &de, sizeof de, di.size) != sizeof de) {
-        free_inode(de.inum);
+    if (inode_write(fs, n, &de, sizeof de, di.size) != sizeof de) {
+        free_inode(fs, de.inum);
         fprintf(stderr, "failed to write %s\n", parent);
         return -1;
     }
     // Inc link count to 1 cus now "parent" dir points to it.
-    read_inode(de.inum, &di);
+    read_inode(fs, de.inum, &di);
     di.linkcnt++;
-    write_inode(de.inum, &di);
+    write_inode(fs, de.inum, &di);
     return 0;
 }
 
-int myfs_open(char *path, u16 mode) {
-    for (int i = 0; i < NFILES; i++) {
-        if (opened[i].inum == NULLINUM) {
-            int inum = lookup(path, 0);
-            if (inum == NULLINUM)
-                return -1;
-            opened[i].inum = inum;
-            opened[i].off = 0;
-            opened[i].mode = mode;
-            opened[i].refcnt = 1;
-            return i;
-        }
-    }
-    return -1;
+static int open_path(struct FileSystem *fs, char *path, u16 mode) {
+    struct files *ft = *fs_files(fs);
+    if (mode != O_RDONLY && fs_rdonly(fs))
+        return -1;
+    u32 inum = lookup(fs, path, 0);
+    if (inum == NULLINUM)
+        return -1;
+    struct ofile *f = malloc(sizeof *f);
+    if (!f)
+        return -1;
+    f->inum = inum;
+    f->off = 0;
+    f->mode = mode;
+    f->refcnt = 0;
+    pthread_mutex_lock(&ft->fdlock);
+    int fd = fdalloc(fs, f);
+    pthread_mutex_unlock(&ft->fdlock);
+    if (fd < 0)
+        free(f);
+    return fd;
+}
+
+// Duplicate 'fd'. Both descriptors share the open file, offset included.
+int myfs_dup(struct FileSystem *fs, int fd) {
+    struct files *ft = *fs_files(fs);
+    struct ofile *f = fdget(fs, fd);
+    if (!f)
+        return -1;
+    pthread_mutex_lock(&ft->fdlock);
+    fd = fdalloc(fs, f);
+    pthread_mutex_unlock(&ft->fdlock);
+    return fd;
 }
 
-int myfs_seek(int fd, u32 off) {
-    if (opened[fd].inum == NULLINUM)
+static int seek_fd(struct FileSystem *fs, int fd, u64 off) {
+    struct files *ft = *fs_files(fs);
+    struct ofile *f = fdget(fs, fd);
+    if (!f || off > MAXFILE_BYTES)
         return -1;
-    opened[fd].off = off;
+    pthread_mutex_lock(&ft->fdlock);
+    f->off = off;
+    pthread_mutex_unlock(&ft->fdlock);
     return 0;
 }
 
-int myfs_write(int fd, void *buf, int sz) {
-    if (!opened[fd].inum || !opened[fd].mode)
+// Write at 'off' without using or moving the file offset
+static int pwrite_fd(struct FileSystem *fs, int fd, void *buf, int sz, u64 off) {
+    struct ofile *f = fdget(fs, fd);
+    if (!f || !f->mode || sz < 0 || off > MAXFILE_BYTES || sz > MAXFILE_BYTES - off)
+        return -1;
+    return inode_write(fs, f->inum, buf, sz, off);
+}
+
+// Read at 'off' without using or moving the file offset
+static int pread_fd(struct FileSystem *fs, int fd, void *buf, int sz, u64 off) {
+    struct ofile *f = fdget(fs, fd);
+    if (!f || f->mode & O_WRONLY)
         return -1;
-    u32 n = inode_write(opened[fd].inum, buf, sz, opened[fd].off);
-    opened[fd].off += n;
+    return inode_read(fs, f->inum, buf, sz, off);
+}
+
+static int write_fd(struct FileSystem *fs, int fd, void *buf, int sz) {
+    struct files *ft = *fs_files(fs);
+    struct ofile *f = fdget(fs, fd);
+    if (!f)
+        return -1;
+    pthread_mutex_lock(&ft->fdlock);
+    u64 off = f->off;
+    pthread_mutex_unlock(&ft->fdlock);
+    int n = pwrite_fd(fs, fd, buf, sz, off);
+    if (n > 0) {
+        pthread_mutex_lock(&ft->fdlock);
+        f->off += n;
+        pthread_mutex_unlock(&ft->fdlock);
+    }
     return n;
 }
 
-int myfs_read(int fd, void *buf, int sz) {
-    if (!opened[fd].inum || opened[fd].mode & O_WRONLY)
+static int read_fd(struct FileSystem *fs, int fd, void *buf, int sz) {
+    struct files *ft = *fs_files(fs);
+    struct ofile *f = fdget(fs, fd);
+    if (!f)
         return -1;
-    u32 n = inode_read(opened[fd].inum, buf, sz, opened[fd].off);
-    opened[fd].off += n;
+    pthread_mutex_lock(&ft->fdlock);
+    u64 off = f->off;
+    pthread_mutex_unlock(&ft->fdlock);
+    int n = pread_fd(fs, fd, buf, sz, off);
+    if (n > 0) {
+        pthread_mutex_lock(&ft->fdlock);
+        f->off += n;
+        pthread_mutex_unlock(&ft->fdlock);
+    }
     return n;
 }
 
@@ -198,7 +375,7 @@ int myfs_read(int fd, void *buf, int sz) {
 // Remove the directory entry from "parent," and decrement
 // the link count of the corresponding inode and free it
 // if the link count reaches to 0.
-int myfs_unlink(char *path) {
+static int unlink_locked(struct FileSystem *fs, char *path) {
     u32 n;
     u32 nn;
     u32 off;
@@ -211,41 +388,41 @@ int myfs_unlink(char *path) {
         return -1;
     }
     // Parent path must points to a valid *directory* inode.
-    n = lookup(path, 1);
+    n = lookup(fs, path, 1);
     if (n == NULLINUM) {
         fprintf(stderr, "parent directory not found %s\n", parent);
         return -1;
     }
-    read_inode(n, &di);
+    read_inode(fs, n, &di);
     if (di.type != T_DIR) {
         fprintf(stderr, "not a directory %s\n", parent);
         return -1;
     }
     // "name" must be in the parent directory
-    nn = dir_lookup(n, name, &off);
-    if ((nn = dir_lookup(n, name, &off)) ==  NULLINUM) {
+    nn = dir_lookup(fs, n, name, &off);
+    if ((nn = dir_lookup(fs, n, name, &off)) ==  NULLINUM) {
         fprintf(stderr, "%s not found under %s\n", name, parent);
         return -1;
     }
     // Zero the directory entry found
     memset(&de, 0, sizeof de);
-    assert(inode_write(n, &de, sizeof de, off) == sizeof de);
+    assert(inode_write(fs, n, &de, sizeof de, off) == sizeof de);
     // Decrement the link count cus "name" no longer points to that inode
-    read_inode(nn, &di);
+    read_inode(fs, nn, &di);
     di.linkcnt--;
     if (!di.linkcnt) {
         // Free the inode if link count reaches 0
-        assert(free_inode(nn));
+        assert(!free_inode(fs, nn));
         return 0;
     }
-    write_inode(nn, &di);
+    write_inode(fs, nn, &di);
     return 0;
 }
 
 // Create a "new" path that points to the same inode the "old" path points to:
 // Given old_parent/dirent{old_name, inum},
 // create new_parent/dirent{new_name, inum}
-int myfs_link(char *new, char *old) {
+static int link_locked(struct FileSystem *fs, char *new, char *old) {
     u32 n;
     u32 nn;
     u32 off;
@@ -258,22 +435,22 @@ int myfs_link(char *new, char *old) {
         return -1;
     }
     // The "old" path must point a valid inode.
-    if ((nn = lookup(old, 0)) != NULLINUM) {
+    if ((nn = lookup(fs, old, 0)) != NULLINUM) {
         fprintf(stderr, "no such file or directory %s\n", old);
         return -1;
     }
     // Parent path must point to a *directory* inode.
-    if ((n = lookup(new, 1)) == NULLINUM) {
+    if ((n = lookup(fs, new, 1)) == NULLINUM) {
         fprintf(stderr, "parent directory not found %s\n", parent);
         return -1;
     }
-    read_inode(n, &di);
+    read_inode(fs, n, &di);
     if (di.type != T_DIR) {
         fprintf(stderr, "not a directory %s\n", parent);
         return -1;
     }
     // "name" must *not* be in "parent" already.
-    if (dir_lookup(n, name, 0) != NULLINUM) {
+    if (dir_lookup(fs, n, name, 0) != NULLINUM) {
         fprintf(stderr, "%s found under %s\n", name, parent);
         return -1;
     }
@@ -281,36 +458,332 @@ int myfs_link(char *new, char *old) {
     // the same inode number as "old"
     de.inum = nn;
     strncpy(de.name, name, MAXNAME);
-    if (inode_write(n, &de, sizeof de, off) != sizeof de) {
+    if (inode_write(fs, n, &de, sizeof de, off) != sizeof de) {
         fprintf(stderr, "failed to append to dir\n");
         return -1;
     }
     // Increment the link count as now new also points to it.
-    read_inode(nn, &di);
+    read_inode(fs, nn, &di);
     di.linkcnt++;
-    write_inode(nn, &di);
+    write_inode(fs, nn, &di);
     return 0;
 }
 
-int myfs_close(int fd) {
-    if (opened[fd].inum == NULLINUM) {
-        fprintf(stderr, "invalid fd\n");
+static int mknod_path(struct FileSystem *fs, char *path, u16 type) {
+    struct files *ft = *fs_files(fs);
+    if (fs_rdonly(fs))
+        return -1;
+    pthread_mutex_lock(&ft->nslock);
+    int ret = mknod_locked(fs, path, type);
+    pthread_mutex_unlock(&ft->nslock);
+    return ret;
+}
+
+static int unlink_path(struct FileSystem *fs, char *path) {
+    struct files *ft = *fs_files(fs);
+    if (fs_rdonly(fs))
+        return -1;
+    pthread_mutex_lock(&ft->nslock);
+    int ret = unlink_locked(fs, path);
+    pthread_mutex_unlock(&ft->nslock);
+    return ret;
+}
+
+static int link_path(struct FileSystem *fs, char *new, char *old) {
+    struct files *ft = *fs_files(fs);
+    if (fs_rdonly(fs))
+        return -1;
+    pthread_mutex_lock(&ft->nslock);
+    int ret = link_locked(fs, new, old);
+    pthread_mutex_unlock(&ft->nslock);
+    return ret;
+}
+
+// Create a regular file at "dst" sharing all data blocks with "src".
+// The copy is instant; blocks are copied only when either file modifies them.
+int myfs_clone(struct FileSystem *fs, char *dst, char *src) {
+    u32 n;
+    u32 nn;
+    struct dinode di;
+    if ((nn = lookup(fs, src, 0)) == NULLINUM) {
+        fprintf(stderr, "no such file or directory %s\n", src);
+        return -1;
+    }
+    read_inode(fs, nn, &di);
+    if (di.type != T_REG) {
+        fprintf(stderr, "not a regular file %s\n", src);
+        return -1;
+    }
+    if (myfs_mknod(fs, dst, T_REG))
+        return -1;
+    assert((n = lookup(fs, dst, 0)) != NULLINUM);
+    if (inode_clone(fs, n, nn)) {
+        fprintf(stderr, "failed to clone %s\n", src);
+        assert(!myfs_unlink(fs, dst));
         return -1;
     }
-    if (!--opened[fd].refcnt)
-        opened[fd].inum = NULLINUM;
     return 0;
 }
 
-int myfs_stat(int fd, struct filestat *st) {
-    if (opened[fd].inum == NULLINUM) {
-        fprintf(stderr, "invalid fd\n");
+static int close_fd(struct FileSystem *fs, int fd) {
+    struct files *ft = *fs_files(fs);
+    struct ofile *f = fdget(fs, fd);
+    if (!f)
         return -1;
+    pthread_mutex_lock(&ft->fdlock);
+    ft->fdtab[fd] = 0;
+    ft->fdnext[fd] = ft->fdfree;
+    ft->fdfree = fd;
+    int last = !--f->refcnt;
+    pthread_mutex_unlock(&ft->fdlock);
+    if (last)
+        free(f);
+    return 0;
+}
+
+// Read up to 'n' live directory entries from the directory opened as 'fd'
+// into 'buf', starting at the current offset. Zeroed (unlinked) slots are
+// skipped. If 'st' is not NULL, it is treated as an array parallel to 'buf'
+// and filled with the type, size and link count of each entry's inode, so
+// callers listing a directory don't need to open and stat every entry.
+// Return the number of entries stored, 0 at the end of the directory,
+// or -1 on error.
+int myfs_readdir(struct FileSystem *fs, int fd, struct dirent *buf, int n, struct filestat *st) {
+    struct files *ft = *fs_files(fs);
+    struct ofile *f = fdget(fs, fd);
+    if (!f)
+        return -1;
+    struct dinode di;
+    read_inode(fs, f->inum, &di);
+    if (di.type != T_DIR)
+        return -1;
+    pthread_mutex_lock(&ft->fdlock);
+    u64 start = f->off;
+    pthread_mutex_unlock(&ft->fdlock);
+    u64 off = start;
+    int cnt = 0;
+    while (cnt < n && off < di.size) {
+        // Pull in a block worth of entries with a single inode read
+        struct dirent des[NDIRENTS_PER_BLOCK];
+        u32 got = inode_read(fs, f->inum, des, sizeof des, off);
+        if (got < sizeof(struct dirent))
+            break;
+        int i;
+        for (i = 0; i < got / sizeof(struct dirent) && cnt < n; i++) {
+            if (!des[i].inum)
+                continue;
+            buf[cnt] = des[i];
+            if (st) {
+                struct dinode de;
+                read_inode(fs, des[i].inum, &de);
+                st[cnt].type = de.type;
+                st[cnt].size = de.size;
+                st[cnt].linkcnt = de.linkcnt;
+                st[cnt].flags = de.type == T_REG ? de.flags : 0;
+            }
+            cnt++;
+        }
+        // Only consume the slots actually examined so that the
+        // next call picks up where this one left off
+        off += i * sizeof(struct dirent);
     }
+    pthread_mutex_lock(&ft->fdlock);
+    f->off += off - start;
+    pthread_mutex_unlock(&ft->fdlock);
+    return cnt;
+}
+
+int myfs_stat(struct FileSystem *fs, int fd, struct filestat *st) {
+    struct ofile *f = fdget(fs, fd);
+    if (!f)
+        return -1;
     struct dinode di;
-    read_inode(opened[fd].inum, &di);
+    read_inode(fs, f->inum, &di);
     st->type = di.type;
     st->linkcnt = di.linkcnt;
     st->size = di.size;
+    st->flags = di.type == T_REG ? di.flags : 0;
+    return 0;
+}
+
+// Set the I_* flags of an empty regular file opened for writing
+int myfs_setflags(struct FileSystem *fs, int fd, u16 flags) {
+    struct ofile *f = fdget(fs, fd);
+    if (!f || !f->mode)
+        return -1;
+    return inode_setflags(fs, f->inum, flags);
+}
+
+// Lay out the empty regular file opened for writing as 'fd' in one run of
+// blocks holding 'size' bytes, for readers that can't follow block maps
+int myfs_reserve(struct FileSystem *fs, int fd, u64 size) {
+    struct ofile *f = fdget(fs, fd);
+    if (!f || !f->mode)
+        return -1;
+    return inode_reserve(fs, f->inum, size);
+}
+
+// Get the first block and the length of the run of a file laid out by
+// myfs_reserve(), indirect blocks included
+int myfs_extent(struct FileSystem *fs, int fd, u32 *start, u32 *len) {
+    struct ofile *f = fdget(fs, fd);
+    if (!f)
+        return -1;
+    return inode_extent(fs, f->inum, start, len);
+}
+
+// Free and used blocks and inodes of the whole image, in constant time
+int myfs_statfs(struct FileSystem *fs, struct fsstat *st) {
+    fs_statfs(fs, st);
+    return 0;
+}
+
+// Write back what was written to 'fd' and wait until it is durable
+int myfs_fsync(struct FileSystem *fs, int fd) {
+    struct ofile *f = fdget(fs, fd);
+    if (!f)
+        return -1;
+    return fs_fsync(fs, f->inum);
+}
+
+// Write back everything and wait until it is durable
+int myfs_sync(struct FileSystem *fs) {
+    return fs_sync(fs);
+}
+
+// Tracing
+//
+// The calls below, which make up the workload of a file system, can be
+// recorded to a host file for replay (see cmd_replay() in main.c). Only
+// their arguments are kept, not the data read or written. With no trace
+// going on, each call costs one more load.
+
+static u64 trace_clock() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Time a call if the calls are traced, return 0 otherwise
+static u64 trace_begin(struct FileSystem *fs) {
+    struct files *ft = *fs_files(fs);
+    return __atomic_load_n(&ft->trace, __ATOMIC_ACQUIRE) ? trace_clock() : 0;
+}
+
+static void trace_path(FILE *f, char *path) {
+    u16 len = strlen(path);
+    fwrite(&len, sizeof len, 1, f);
+    fwrite(path, 1, len, f);
+}
+
+// Record the call started at 't', if it was traced
+static void trace_end(struct FileSystem *fs, u64 t, struct trace_rec *r, char *p1, char *p2) {
+    struct files *ft = *fs_files(fs);
+    if (!t)
+        return;
+    r->lat = trace_clock() - t;
+    r->npath = !!p1 + !!p2;
+    pthread_mutex_lock(&ft->tlock);
+    if (ft->trace) {
+        r->start = t - ft->tstart;
+        fwrite(r, sizeof *r, 1, ft->trace);
+        if (p1)
+            trace_path(ft->trace, p1);
+        if (p2)
+            trace_path(ft->trace, p2);
+    }
+    pthread_mutex_unlock(&ft->tlock);
+}
+
+/**
+ * @brief Start recording the calls to 'path' on the host, or stop if NULL
+ * 
+ * @return int 0 on success, -1 if the trace file could not be created.
+ */
+int myfs_trace(struct FileSystem *fs, const char *path) {
+    struct files *ft = *fs_files(fs);
+    FILE *f = 0;
+    if (path) {
+        struct trace_hdr h = { TRACEMAGIC, sizeof(struct trace_rec) };
+        if (!(f = fopen(path, "w")))
+            return -1;
+        fwrite(&h, sizeof h, 1, f);
+    }
+    pthread_mutex_lock(&ft->tlock);
+    if (ft->trace)
+        fclose(ft->trace);
+    ft->tstart = trace_clock();
+    __atomic_store_n(&ft->trace, f, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&ft->tlock);
     return 0;
 }
+
+int myfs_open(struct FileSystem *fs, char *path, u16 mode) {
+    u64 t = trace_begin(fs);
+    int fd = open_path(fs, path, mode);
+    trace_end(fs, t, &(struct trace_rec){ .op = TR_OPEN, .arg = mode, .fd = fd, .ret = fd }, path, 0);
+    return fd;
+}
+
+int myfs_close(struct FileSystem *fs, int fd) {
+    u64 t = trace_begin(fs);
+    int ret = close_fd(fs, fd);
+    trace_end(fs, t, &(struct trace_rec){ .op = TR_CLOSE, .fd = fd, .ret = ret }, 0, 0);
+    return ret;
+}
+
+int myfs_seek(struct FileSystem *fs, int fd, u64 off) {
+    u64 t = trace_begin(fs);
+    int ret = seek_fd(fs, fd, off);
+    trace_end(fs, t, &(struct trace_rec){ .op = TR_SEEK, .fd = fd, .off = off, .ret = ret }, 0, 0);
+    return ret;
+}
+
+int myfs_read(struct FileSystem *fs, int fd, void *buf, int sz) {
+    u64 t = trace_begin(fs);
+    int ret = read_fd(fs, fd, buf, sz);
+    trace_end(fs, t, &(struct trace_rec){ .op = TR_READ, .fd = fd, .sz = sz, .ret = ret }, 0, 0);
+    return ret;
+}
+
+int myfs_write(struct FileSystem *fs, int fd, void *buf, int sz) {
+    u64 t = trace_begin(fs);
+    int ret = write_fd(fs, fd, buf, sz);
+    trace_end(fs, t, &(struct trace_rec){ .op = TR_WRITE, .fd = fd, .sz = sz, .ret = ret }, 0, 0);
+    return ret;
+}
+
+int myfs_pread(struct FileSystem *fs, int fd, void *buf, int sz, u64 off) {
+    u64 t = trace_begin(fs);
+    int ret = pread_fd(fs, fd, buf, sz, off);
+    trace_end(fs, t, &(struct trace_rec){ .op = TR_PREAD, .fd = fd, .sz = sz, .off = off, .ret = ret }, 0, 0);
+    return ret;
+}
+
+int myfs_pwrite(struct FileSystem *fs, int fd, void *buf, int sz, u64 off) {
+    u64 t = trace_begin(fs);
+    int ret = pwrite_fd(fs, fd, buf, sz, off);
+    trace_end(fs, t, &(struct trace_rec){ .op = TR_PWRITE, .fd = fd, .sz = sz, .off = off, .ret = ret }, 0, 0);
+    return ret;
+}
+
+int myfs_mknod(struct FileSystem *fs, char *path, u16 type) {
+    u64 t = trace_begin(fs);
+    int ret = mknod_path(fs, path, type);
+    trace_end(fs, t, &(struct trace_rec){ .op = TR_MKNOD, .arg = type, .ret = ret }, path, 0);
+    return ret;
+}
+
+int myfs_unlink(struct FileSystem *fs, char *path) {
+    u64 t = trace_begin(fs);
+    int ret = unlink_path(fs, path);
+    trace_end(fs, t, &(struct trace_rec){ .op = TR_UNLINK, .ret = ret }, path, 0);
+    return ret;
+}
+
+int myfs_link(struct FileSystem *fs, char *new, char *old) {
+    u64 t = trace_begin(fs);
+    int ret = link_path(fs, new, old);
+    trace_end(fs, t, &(struct trace_rec){ .op = TR_LINK, .ret = ret }, new, old);
+    return ret;
+}
@@ -1,26 +1,66 @@
 #include "types.h"
 
-// opened file structure
+// opened file structure, shared by the descriptors dup'ed from one another
 struct ofile {
-    u32 off;
+    u64 off;
     u32 inum;
-    u32 refcnt;
+    u32 refcnt;     // number of descriptors pointing to it
     u32 mode;
 };
 
 // file status
 struct filestat {
     u16 type;
-    u32 size;
+    u64 size;
     u16 linkcnt;
+    u16 flags;
 };
 
-int myfs_mknod(char *path, u16 type);
-int myfs_open(char *path, u16 mode);
-int myfs_seek(int fd, u32 off);
-int myfs_write(int fd, void *buf, int sz);
-int myfs_read(int fd, void *buf, int sz);
-int myfs_unlink(char *path);
-int myfs_link(char *new, char *old);
-int myfs_stat(int fd, struct filestat *st);
-int myfs_close(int fd);
+// Call trace (see myfs_trace()): a trace_hdr, then a trace_rec per call, in
+// the order the calls returned, each followed by its 'npath' paths, stored
+// as a u16 length and the bytes of the path without the terminating 0.
+#define TRACEMAGIC 0x5254594d // "MYTR"
+
+enum { TR_OPEN = 1, TR_CLOSE, TR_READ, TR_WRITE, TR_PREAD, TR_PWRITE, TR_SEEK, TR_MKNOD, TR_UNLINK, TR_LINK };
+
+struct trace_hdr {
+    u32 magic;
+    u32 recsize;    // sizeof(struct trace_rec)
+};
+
+struct trace_rec {
+    u8 op;          // TR_*
+    u8 npath;       // Paths following: mknod, unlink and open 1, link 2 (new, old)
+    u16 arg;        // Mode of open, type of mknod
+    int fd;         // Descriptor passed, or returned by open
+    int ret;        // Return value
+    u32 sz;         // Bytes asked for by read and write
+    u64 off;        // Offset of pread, pwrite and seek
+    u64 start;      // When the call was made, in ns since the trace began
+    u64 lat;        // ns spent in the call
+};
+
+struct FileSystem *myfs_mount(const char *vhd, const char *log);
+struct FileSystem *myfs_mount_rdonly(const char *vhd, const char *log);
+void myfs_unmount(struct FileSystem *fs);
+int myfs_mknod(struct FileSystem *fs, char *path, u16 type);
+int myfs_open(struct FileSystem *fs, char *path, u16 mode);
+int myfs_dup(struct FileSystem *fs, int fd);
+int myfs_seek(struct FileSystem *fs, int fd, u64 off);
+int myfs_write(struct FileSystem *fs, int fd, void *buf, int sz);
+int myfs_read(struct FileSystem *fs, int fd, void *buf, int sz);
+int myfs_pwrite(struct FileSystem *fs, int fd, void *buf, int sz, u64 off);
+int myfs_pread(struct FileSystem *fs, int fd, void *buf, int sz, u64 off);
+int myfs_unlink(struct FileSystem *fs, char *path);
+int myfs_link(struct FileSystem *fs, char *new, char *old);
+int myfs_clone(struct FileSystem *fs, char *dst, char *src);
+int myfs_stat(struct FileSystem *fs, int fd, struct filestat *st);
+int myfs_setflags(struct FileSystem *fs, int fd, u16 flags);
+int myfs_reserve(struct FileSystem *fs, int fd, u64 size);
+int myfs_extent(struct FileSystem *fs, int fd, u32 *start, u32 *len);
+int myfs_statfs(struct FileSystem *fs, struct fsstat *st);
+int myfs_fsync(struct FileSystem *fs, int fd);
+int myfs_sync(struct FileSystem *fs);
+int myfs_readdir(struct FileSystem *fs, int fd, struct dirent *buf, int n, struct filestat *st);
+int myfs_close(struct FileSystem *fs, int fd);
+int myfs_trace(struct FileSystem *fs, const char *path);
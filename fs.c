@@ -9,7 +9,11 @@
  * 
  */
 
+#define _GNU_SOURCE // O_DIRECT
+
 #include "fs.h"
+#include "lz.h"
+#include "crc32c.h"
 
 #include <fcntl.h>
 #include <stdio.h>
@@ -18,75 +22,405 @@
 #include <assert.h>
 #include <string.h>
 #include <stdarg.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static void fs_checker(struct FileSystem *fs);
+static int sync_all(struct FileSystem *fs);
+static void ref_set(struct FileSystem *fs, u32 n, u16 cnt);
+static u32 bmap(struct FileSystem *fs, struct dinode *di, u32 lblock);
+static void bmcache_forget(struct FileSystem *fs, u32 n);
+static void cache_drop(struct FileSystem *fs, u32 n);
+static void write_su(struct FileSystem *fs);
+
+// Delayed allocation page cache (see inode_write())
+#define NPAGES 128
+
+// Block map cache (see bmap_cached())
+#define NBMCACHE 1024
 
-static void fs_checker();
+struct bmcache_ent {
+    u32 inum;
+    u32 lblock;             /**< ~0 if the slot is free */
+    u32 pblock;             /**< 0 for a hole */
+    u32 gen;                /**< fs->mgen[inum] when cached */
+};
+
+// Writeback defaults (see fs_writeback())
+#define FLUSH_AGE 5000      // Pages older than this many ms are written back
+#define FLUSH_RATIO 50      // So are the oldest files' once this % of the pages is in use
+
+struct page {
+    u32 inum;               /**< Owning inode, 0 if the slot is free */
+    u32 lblock;             /**< Block index within the file */
+    u64 dirtied;            /**< When the page was added, in ms (see now_ms()) */
+    int next;               /**< Next page in the same hash bucket or on the free list, -1 at the end */
+    u8 data[BLOCKSIZE];
+};
 
 /**
- * @brief Structure representing the file system
+ * @brief Structure representing the file system, returned by fs_init()
  */
 struct FileSystem {
     FILE *log;
     int vd;                 /**< File descriptor pointing to the "virtual disk" */
+    u8 *map;                /**< The image mapped read-only (see fs_init_rdonly()), NULL if writable */
+    char *path;             /**< Path of the image, to open it again for direct I/O */
+    int dvd;                /**< The image opened O_DIRECT (see fs_direct()), -1 if not in use */
     struct superblock su;   /**< In-memory copy of the superblock */
-} fs;
+    u32 *csum;              /**< In-memory copy of the checksum blocks, indexed by block number */
+    // Deduplication fingerprint index (see fs_dedup()), indexed by data block offset
+    u32 *fphead;            /**< Hash buckets: data block offset + 1 of the first entry, 0 if empty */
+    u32 *fpnext;            /**< Next entry in the same bucket, same encoding as fphead */
+    u32 *fpval;             /**< Fingerprint of each indexed block, 0 if not indexed */
+    u32 nfpbucket;
+    u32 ndedup;             /**< Blocks deduplicated since fs_dedup(1) */
+    u32 *hint;              /**< Per-inode allocation goal for files without blocks yet (see inode_hint()) */
+    struct page *pages;     /**< Dirty file blocks not allocated on disk yet */
+    int pbucket[NPAGES];    /**< Hash buckets: index of the first page, -1 if empty */
+    int pfree;              /**< First free page, -1 if the cache is full */
+    u16 *npages;            /**< Number of cached pages of each inode */
+    int nused;              /**< Number of pages in use */
+    u16 *nneed;             /**< Pages of each inode counted by cache_reserve() */
+    u8 *wberr;              /**< Set for an inode a flush failed on, until fs_fsync() or fs_sync() reports it */
+    u32 nreserved;          /**< Free blocks promised to them, with fs->alock */
+    // Background writeback (see "Writeback" below)
+    pthread_t flusher;
+    int flushing;           /**< Set while the flusher thread runs */
+    int fstop;              /**< Set to have it exit */
+    pthread_cond_t fcond;   /**< Wakes it up, with fs->plock */
+    u32 flush_age;          /**< ms */
+    u32 flush_ratio;        /**< % of NPAGES */
+    u32 *gen;               /**< In-memory copy of the generation blocks (FEAT_CBT), NULL without them */
+    u8 *gdirty;             /**< Generation blocks changed since last written */
+    struct bmcache_ent *bmcache; /**< Recently mapped file blocks, NULL on read-only mounts */
+    u32 *mgen;              /**< Per-inode block map generation, bumped when the inode is written */
+    u64 nbread;             /**< Blocks read from the image (see fs_iostat()) */
+    u64 nbwritten;          /**< Blocks written to it */
+    // Locks (see "Locking" below)
+    pthread_rwlock_t lock;
+    pthread_rwlock_t *ilock;
+    pthread_mutex_t alock;
+    pthread_mutex_t itlock;
+    pthread_mutex_t plock;
+    pthread_mutex_t clock;
+    pthread_mutex_t glock;
+    pthread_mutex_t mlock;
+    void *files;            /**< State of the file layer (see fs_files()) */
+};
+
+// Run reserved by inode_flush() in this thread: next block and blocks left.
+// A thread flushes one file system at a time, so these need no handle.
+static __thread u32 resv;
+static __thread u32 nresv;
 
-static void mylog(const char *format, ...) {
+static void mylog(struct FileSystem *fs, const char *format, ...) {
     va_list args;
+    if (!fs->log)
+        return;
     va_start(args, format);
-    vfprintf(fs.log, format, args);
+    vfprintf(fs->log, format, args);
     va_end(args);
-    fflush(fs.log);
+    fflush(fs->log);
+}
+
+// Locking
+//
+// Nothing changes on a read-only mount, which takes none of the locks on the
+// paths that read files and directories. Otherwise, fs->lock is held shared
+// by the operations on single inodes and exclusive by the ones that walk the
+// whole tree: snapshots, clones, dedup, defrag, scrub, sync and fs_checker().
+// A thread may take it again while holding it, so entry points can call each
+// other. Under it, each inode has a
+// reader/writer lock for its data, and mutexes guard the structures shared
+// between inodes: fs->alock the block allocator (bitmap, refcounts and dedup
+// index), fs->itlock the inode table and fs->plock the page cache. fs->clock,
+// for the checksum table, is the only lock taken while holding another one
+// of those mutexes, apart from fs->glock, for the generation table, and
+// fs->mlock, for the block map cache, which nothing is taken under.
+
+static __thread int lock_depth; // Times this thread holds fs->lock
+static __thread int lock_excl;  // Set if it holds it exclusively
+static __thread struct FileSystem *lock_fs; // The fs it belongs to
+
+static void fs_lock(struct FileSystem *fs, int excl)
+{
+    if (fs->map)
+        return;
+    if (lock_depth++) {
+        assert(lock_fs == fs && (lock_excl || !excl));
+        return;
+    }
+    lock_fs = fs;
+    if (excl)
+        pthread_rwlock_wrlock(&fs->lock);
+    else
+        pthread_rwlock_rdlock(&fs->lock);
+    lock_excl = excl;
+}
+
+static void fs_unlock(struct FileSystem *fs)
+{
+    if (fs->map)
+        return;
+    if (!--lock_depth)
+        pthread_rwlock_unlock(&fs->lock);
+}
+
+static void locks_init(struct FileSystem *fs)
+{
+    pthread_mutexattr_t attr;
+    // The allocator functions call each other
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&fs->alock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    pthread_rwlock_init(&fs->lock, 0);
+    pthread_mutex_init(&fs->itlock, 0);
+    pthread_mutex_init(&fs->plock, 0);
+    pthread_mutex_init(&fs->clock, 0);
+    pthread_mutex_init(&fs->glock, 0);
+    pthread_mutex_init(&fs->mlock, 0);
+    assert((fs->ilock = malloc(fs->su.ninodes * sizeof(pthread_rwlock_t))));
+    for (u32 i = 0; i < fs->su.ninodes; i++)
+        pthread_rwlock_init(&fs->ilock[i], 0);
+}
+
+static void locks_destroy(struct FileSystem *fs)
+{
+    for (u32 i = 0; i < fs->su.ninodes; i++)
+        pthread_rwlock_destroy(&fs->ilock[i]);
+    free(fs->ilock);
+    pthread_rwlock_destroy(&fs->lock);
+    pthread_mutex_destroy(&fs->alock);
+    pthread_mutex_destroy(&fs->itlock);
+    pthread_mutex_destroy(&fs->plock);
+    pthread_mutex_destroy(&fs->clock);
+    pthread_mutex_destroy(&fs->glock);
+    pthread_mutex_destroy(&fs->mlock);
+}
+
+// Block checksums
+//
+// Every block from the superblock on has a CRC32C entry in the checksum
+// blocks, which are kept in memory in fs->csum and written through when an
+// entry changes. An entry of 0 means the block is not checksummed: that is
+// the case for the checksum blocks themselves, for blocks never written since
+// the format, and for file data blocks unless the image has FEAT_CSUM_DATA.
+// A computed CRC of 0 is stored as 1.
+
+static u32 block_csum(void *buf)
+{
+    u32 c = crc32c(0, buf, BLOCKSIZE);
+    return c ? c : 1;
+}
+
+// Check a block just read against its checksum entry
+static int csum_verify(struct FileSystem *fs, int n, void *buf)
+{
+    if (!fs->csum || n < SUBLOCK_NUM || !fs->csum[n])
+        return 0;
+    return block_csum(buf) == fs->csum[n] ? 0 : -1;
+}
+
+static void disk_write(struct FileSystem *fs, int n, void *buf);
+
+// Record the checksum of block n, 0 for none
+static void csum_update(struct FileSystem *fs, int n, u32 c)
+{
+    if (!fs->csum || n < SUBLOCK_NUM || fs->csum[n] == c)
+        return;
+    // The checksum blocks are not covered
+    if (n >= fs->su.scsum && n < fs->su.scsum + fs->su.nblock_csum)
+        return;
+    pthread_mutex_lock(&fs->clock);
+    fs->csum[n] = c;
+    n /= NCSUMS_PER_BLOCK;
+    disk_write(fs, fs->su.scsum + n, &fs->csum[n * NCSUMS_PER_BLOCK]);
+    pthread_mutex_unlock(&fs->clock);
+}
+
+// Changed-block tracking
+//
+// On images with FEAT_CBT, the generation blocks hold the generation in
+// which each block was last written. They are kept in memory in fs->gen and
+// written back by cbt_flush() when the generation is bumped and when
+// unmounting, so after a crash the table is presumed stale and every block
+// is counted as written in the current generation. Only the generation
+// blocks themselves are not tracked, nor checksummed.
+
+static int cbt_covers(struct FileSystem *fs, u32 n)
+{
+    return fs->gen && !(n >= fs->su.sgen && n < fs->su.sgen + fs->su.nblock_gen);
+}
+
+static void cbt_mark(struct FileSystem *fs, u32 n)
+{
+    if (!cbt_covers(fs, n))
+        return;
+    pthread_mutex_lock(&fs->glock);
+    if (fs->gen[n] != fs->su.gen) {
+        fs->gen[n] = fs->su.gen;
+        fs->gdirty[n / NPTRS_PER_BLOCK] = 1;
+    }
+    pthread_mutex_unlock(&fs->glock);
+}
+
+// Count blocks transferred, from any thread
+static void iostat_add(u64 *cnt, u32 n)
+{
+    __atomic_fetch_add(cnt, n, __ATOMIC_RELAXED);
+}
+
+// Write back the generation blocks changed
+static void cbt_flush(struct FileSystem *fs)
+{
+    if (!fs->gen)
+        return;
+    pthread_mutex_lock(&fs->glock);
+    for (u32 i = 0; i < fs->su.nblock_gen; i++)
+        if (fs->gdirty[i]) {
+            assert(pwrite(fs->vd, &fs->gen[i * NPTRS_PER_BLOCK], BLOCKSIZE,
+                          (off_t)(fs->su.sgen + i) * BLOCKSIZE) == BLOCKSIZE);
+            fs->gdirty[i] = 0;
+            iostat_add(&fs->nbwritten, 1);
+        }
+    pthread_mutex_unlock(&fs->glock);
 }
 
 /**
- * @brief Write a disk block
+ * @brief Write a disk block, with or without a checksum
  * 
  * @param n     The number of the block where the data is to be written
  * @param buf   A pointer to the buffer containing the data to be written to the disk block
+ * @param csum  Record a checksum for the block if set, clear it otherwise
  */
-static void disk_write(int n, void *buf)
+static void block_write(struct FileSystem *fs, int n, void *buf, int csum)
 {
-    assert(lseek(fs.vd, n * BLOCKSIZE, SEEK_SET) == n * BLOCKSIZE);
-    assert(write(fs.vd, buf, BLOCKSIZE) == BLOCKSIZE);
+    assert(!fs->map);
+    assert(pwrite(fs->vd, buf, BLOCKSIZE, (off_t)n * BLOCKSIZE) == BLOCKSIZE);
+    iostat_add(&fs->nbwritten, 1);
+    cbt_mark(fs, n);
+    csum_update(fs, n, csum ? block_csum(buf) : 0);
 }
 
 /**
- * @brief Read a disk block
+ * @brief Read a disk block without checksum verification
  * 
  * @param n     The number of the block to be read from
  * @param buf   A pointer to the buffer where the read data will be stored
  */
-static void disk_read(int n, void *buf)
+static void block_read(struct FileSystem *fs, int n, void *buf)
 {
-    assert(lseek(fs.vd, n * BLOCKSIZE, SEEK_SET) == n * BLOCKSIZE);
-    assert(read(fs.vd, buf, BLOCKSIZE) == BLOCKSIZE);
+    iostat_add(&fs->nbread, 1);
+    if (fs->map) {
+        assert(n >= 0 && n < fs->su.nblock_tot);
+        memcpy(buf, fs->map + (size_t)n * BLOCKSIZE, BLOCKSIZE);
+        return;
+    }
+    assert(pread(fs->vd, buf, BLOCKSIZE, (off_t)n * BLOCKSIZE) == BLOCKSIZE);
+}
+
+/**
+ * @brief Write a metadata disk block, which is always checksummed
+ * 
+ * @param n     The number of the block where the data is to be written
+ * @param buf   A pointer to the buffer containing the data to be written to the disk block
+ */
+static void disk_write(struct FileSystem *fs, int n, void *buf)
+{
+    block_write(fs, n, buf, 1);
+}
+
+/**
+ * @brief Read a disk block, verifying its checksum if it has one
+ * 
+ * @param n     The number of the block to be read from
+ * @param buf   A pointer to the buffer where the read data will be stored
+ */
+static void disk_read(struct FileSystem *fs, int n, void *buf)
+{
+    block_read(fs, n, buf);
+    if (csum_verify(fs, n, buf)) {
+        fprintf(stderr, "checksum mismatch on block %d\n", n);
+        exit(1);
+    }
+}
+
+/**
+ * @brief Get a disk block of a read-only mount in place, verifying its checksum
+ * 
+ * @param n The number of the block
+ * @return void* The block in the mapped image
+ */
+static void *disk_map(struct FileSystem *fs, int n)
+{
+    assert(fs->map && n >= 0 && n < fs->su.nblock_tot);
+    void *p = fs->map + (size_t)n * BLOCKSIZE;
+    iostat_add(&fs->nbread, 1);
+    if (csum_verify(fs, n, p)) {
+        fprintf(stderr, "checksum mismatch on block %d\n", n);
+        exit(1);
+    }
+    return p;
+}
+
+// Free blocks not held back for the dirty pages of any file (see
+// cache_reserve()). inode_flush() gives back what its own pages held before
+// allocating, so it is the only one to use those. The caller holds fs->alock.
+static u32 nfree_unheld(struct FileSystem *fs)
+{
+    return fs->su.nfree > fs->nreserved ? fs->su.nfree - fs->nreserved : 0;
 }
 
 /**
  * @brief Bitmap operations: Allocate a data block
  * 
+ * The search starts at 'goal' and moves outward from it, one block at a time
+ * in both directions, trying the block after before the block before. Callers
+ * pass the block following the previous one of the same file, so sequential
+ * writes get sequential blocks whenever the space allows.
+ * 
+ * @param goal  The preferred block, or 0 for the lowest free block
  * @return u32  The number of the allocated data block, or 0 if allocation fails
  */
-static u32 bitmap_alloc() 
+static u32 bitmap_alloc(struct FileSystem *fs, u32 goal) 
 {
     union block b;
-    disk_read(fs.su.sbitmap, &b);
-    for (int i = 0; i < fs.su.nblock_dat / 8; i++) {
-        if (b.bytes[i] == 0xff)
-            continue;
-        // bytes[i] must has at least one 0 bit
-        int off;
-        for (off = 0; off < 8; off++)
-            if (!((b.bytes[i] >> off) & 1))
-                break;
-        if (off + i * 8 >= fs.su.nblock_dat)
-            return 0;
-        assert(off != 8);
-        b.bytes[i] |= 1 << off;
-        disk_write(fs.su.sbitmap, &b);
-        return off + i * 8 + fs.su.sdata;
+    int nbits = fs->su.nblock_dat / 8 * 8; // only whole bytes of the bitmap are used
+    int g = goal >= fs->su.sdata && goal < fs->su.sdata + nbits ? goal - fs->su.sdata : 0;
+    int found = -1;
+    // While a flush has a run reserved, hand out its blocks in order.
+    // They are already marked in the bitmap with one reference.
+    if (nresv) {
+        nresv--;
+        return resv++;
     }
-    return 0;
+    pthread_mutex_lock(&fs->alock);
+    // Full: fail without scanning the bitmap
+    if (!nfree_unheld(fs)) {
+        pthread_mutex_unlock(&fs->alock);
+        return 0;
+    }
+    disk_read(fs, fs->su.sbitmap, &b);
+    for (int d = 0; found < 0 && (g + d < nbits || g - d >= 0); d++) {
+        if (g + d < nbits && !((b.bytes[(g+d)/8] >> ((g+d)%8)) & 1))
+            found = g + d;
+        else if (d && g - d >= 0 && !((b.bytes[(g-d)/8] >> ((g-d)%8)) & 1))
+            found = g - d;
+    }
+    if (found >= 0) {
+        b.bytes[found/8] |= 1 << (found%8);
+        disk_write(fs, fs->su.sbitmap, &b);
+        fs->su.nfree--;
+        // A fresh block has exactly one referrer: the caller
+        ref_set(fs, found + fs->su.sdata, 1);
+    }
+    pthread_mutex_unlock(&fs->alock);
+    return found < 0 ? 0 : found + fs->su.sdata;
 }
 
 /**
@@ -96,20 +430,243 @@ static u32 bitmap_alloc()
  * @return int  Returns 0 if the data block is successfully freed, or -1 if an error occurs
  * 
  */
-static int bitmap_free(u32 n) 
+static int bitmap_free(struct FileSystem *fs, u32 n) 
 {
     union block b;
-    if (n < fs.su.sdata || n >= fs.su.sdata + fs.su.nblock_dat)
+    if (n < fs->su.sdata || n >= fs->su.sdata + fs->su.nblock_dat)
         return -1;
-    disk_read(fs.su.sbitmap, &b);
+    // Bits are indexed relative to the start of the data section
+    n -= fs->su.sdata;
+    pthread_mutex_lock(&fs->alock);
+    disk_read(fs, fs->su.sbitmap, &b);
     // Double free?
-    if (!(b.bytes[n/8] & (1 << (n%8))))
-        return -1;
+    int ret = b.bytes[n/8] & (1 << (n%8)) ? 0 : -1;
     b.bytes[n/8] &= ~(1 << (n%8));
-    disk_write(fs.su.sbitmap, &b);
+    if (!ret) {
+        disk_write(fs, fs->su.sbitmap, &b);
+        fs->su.nfree++;
+    }
+    pthread_mutex_unlock(&fs->alock);
+    return ret;
+}
+
+/**
+ * @brief Bitmap operations: Find a run of free data blocks
+ * 
+ * The caller holds fs->alock until it has allocated the run.
+ * 
+ * @param len   The number of blocks needed
+ * @param goal  The block where the search starts; it wraps around to the start of the data section
+ * @return u32  The first block of the run, or 0 if there is no such run
+ */
+static u32 bitmap_find_run(struct FileSystem *fs, u32 len, u32 goal)
+{
+    union block b;
+    u32 nbits = fs->su.nblock_dat / 8 * 8; // only whole bytes of the bitmap are used
+    u32 g = goal >= fs->su.sdata && goal < fs->su.sdata + nbits ? goal - fs->su.sdata : 0;
+    if (!len || len > nbits || len > nfree_unheld(fs))
+        return 0;
+    disk_read(fs, fs->su.sbitmap, &b);
+    for (int pass = 0; pass < 2; pass++) {
+        u32 s = pass ? 0 : g;
+        u32 e = pass ? g + len - 1 : nbits;
+        u32 run = 0;
+        for (u32 i = s; i < e && i < nbits; i++) {
+            run = (b.bytes[i/8] >> (i%8)) & 1 ? 0 : run + 1;
+            if (run == len)
+                return i + 1 - len + fs->su.sdata;
+        }
+    }
     return 0;
 }
 
+/**
+ * @brief Bitmap operations: Allocate a run of data blocks found by bitmap_find_run()
+ * 
+ * @param n     The first block of the run
+ * @param len   The number of blocks in the run
+ */
+static void bitmap_alloc_run(struct FileSystem *fs, u32 n, u32 len)
+{
+    union block b;
+    disk_read(fs, fs->su.sbitmap, &b);
+    for (u32 i = n - fs->su.sdata; i < n - fs->su.sdata + len; i++) {
+        assert(!((b.bytes[i/8] >> (i%8)) & 1));
+        b.bytes[i/8] |= 1 << (i%8);
+    }
+    disk_write(fs, fs->su.sbitmap, &b);
+    fs->su.nfree -= len;
+    for (u32 i = 0; i < len; i++)
+        ref_set(fs, n + i, 1);
+}
+
+// Block reference counts
+//
+// Each data block has a u16 reference count in the refcount blocks, counting
+// the block pointers (in inodes, indirect blocks or snapshot roots) that point
+// to it. The bitmap still records which blocks are in use: a block is set in
+// the bitmap iff its count is non-zero. Blocks with a count above 1 are shared
+// and must be copied before being modified (see block_unshare()).
+
+static u16 ref_get(struct FileSystem *fs, u32 n)
+{
+    union block b;
+    n -= fs->su.sdata;
+    pthread_mutex_lock(&fs->alock);
+    disk_read(fs, fs->su.srefcnt + n/NREFS_PER_BLOCK, &b);
+    pthread_mutex_unlock(&fs->alock);
+    return b.refs[n%NREFS_PER_BLOCK];
+}
+
+static void ref_set(struct FileSystem *fs, u32 n, u16 cnt)
+{
+    union block b;
+    n -= fs->su.sdata;
+    pthread_mutex_lock(&fs->alock);
+    disk_read(fs, fs->su.srefcnt + n/NREFS_PER_BLOCK, &b);
+    b.refs[n%NREFS_PER_BLOCK] = cnt;
+    disk_write(fs, fs->su.srefcnt + n/NREFS_PER_BLOCK, &b);
+    pthread_mutex_unlock(&fs->alock);
+}
+
+/**
+ * @brief Add a reference to a data block
+ * 
+ * @param n The number of the data block
+ * @return int Returns 0 on success, or -1 if the count would overflow
+ */
+static int ref_inc(struct FileSystem *fs, u32 n)
+{
+    pthread_mutex_lock(&fs->alock);
+    u16 cnt = ref_get(fs, n);
+    assert(cnt);
+    if (cnt != (u16)-1)
+        ref_set(fs, n, cnt + 1);
+    pthread_mutex_unlock(&fs->alock);
+    return cnt == (u16)-1 ? -1 : 0;
+}
+
+// Deduplication fingerprint index
+//
+// While deduplication is on, each full data block written to a regular file
+// is hashed and indexed by its fingerprint (its CRC32C, never 0). A later
+// block with the same fingerprint is compared byte by byte with the indexed
+// one and, if identical, shares it instead of getting a block of its own.
+// Blocks leave the index when freed. One that is modified in place stays
+// indexed under a stale fingerprint, which the byte comparison rejects.
+
+static u32 dedup_fp(void *buf)
+{
+    u32 fp = crc32c(0, buf, BLOCKSIZE);
+    return fp ? fp : 1;
+}
+
+static void dedup_insert(struct FileSystem *fs, u32 n, u32 fp)
+{
+    u32 i = n - fs->su.sdata;
+    u32 h = fp % fs->nfpbucket;
+    pthread_mutex_lock(&fs->alock);
+    if (!fs->fpval[i]) {
+        fs->fpval[i] = fp;
+        fs->fpnext[i] = fs->fphead[h];
+        fs->fphead[h] = i + 1;
+    }
+    pthread_mutex_unlock(&fs->alock);
+}
+
+static void dedup_forget(struct FileSystem *fs, u32 n)
+{
+    u32 i = n - fs->su.sdata;
+    if (!fs->fpval || !fs->fpval[i])
+        return;
+    u32 *pe = &fs->fphead[fs->fpval[i] % fs->nfpbucket];
+    for (; *pe != i + 1; pe = &fs->fpnext[*pe - 1])
+        assert(*pe);
+    *pe = fs->fpnext[i];
+    fs->fpval[i] = 0;
+}
+
+/**
+ * @brief Drop a reference to a data block, freeing it with the last one
+ * 
+ * @param n The number of the data block
+ * @return int The number of references left
+ */
+static int ref_dec(struct FileSystem *fs, u32 n)
+{
+    pthread_mutex_lock(&fs->alock);
+    u16 cnt = ref_get(fs, n);
+    assert(cnt);
+    ref_set(fs, n, --cnt);
+    if (!cnt) {
+        assert(!bitmap_free(fs, n));
+        dedup_forget(fs, n);
+    }
+    pthread_mutex_unlock(&fs->alock);
+    return cnt;
+}
+
+// Inode table
+//
+// On images formatted with FEAT_LAZY_ITABLE, only the first su.itable_init
+// inode blocks have ever been written. The others read as zeros without
+// touching the disk, whatever it holds there. Writing one of them zeroes
+// the blocks before it and moves the mark past it. The caller holds
+// fs->itlock or fs->lock exclusively.
+
+static void itable_read(struct FileSystem *fs, u32 i, union block *b)
+{
+    if ((fs->su.features & FEAT_LAZY_ITABLE) && i >= fs->su.itable_init) {
+        memset(b, 0, sizeof *b);
+        return;
+    }
+    disk_read(fs, fs->su.sinode + i, b);
+}
+
+static void itable_write(struct FileSystem *fs, u32 i, union block *b)
+{
+    if ((fs->su.features & FEAT_LAZY_ITABLE) && i >= fs->su.itable_init) {
+        union block z;
+        memset(&z, 0, sizeof z);
+        for (u32 j = fs->su.itable_init; j < i; j++)
+            disk_write(fs, fs->su.sinode + j, &z);
+        disk_write(fs, fs->su.sinode + i, b);
+        // Only now that the blocks hold what they should
+        fs->su.itable_init = i + 1;
+        write_su(fs);
+        return;
+    }
+    disk_write(fs, fs->su.sinode + i, b);
+}
+
+// Add 'd' times the inodes allocated in inode block 'b' to the usage counters in 'su'
+static void itable_account(struct superblock *su, union block *b, int d)
+{
+    for (int j = 0; j < NINODES_PER_BLOCK; j++)
+        if (b->inodes[j].type) {
+            su->ntype[b->inodes[j].type] += d;
+            su->nifree -= d;
+        }
+}
+
+// Compute the usage counters of 'su' the slow way, from the bitmap and the
+// inode table, for an image not unmounted cleanly and for fs_checker()
+static void usage_scan(struct FileSystem *fs, struct superblock *su)
+{
+    union block b;
+    u32 nbits = fs->su.nblock_dat / 8 * 8; // only whole bytes of the bitmap are used
+    disk_read(fs, fs->su.sbitmap, &b);
+    su->nfree = 0;
+    for (u32 i = 0; i < nbits; i++)
+        su->nfree += !((b.bytes[i/8] >> (i%8)) & 1);
+    su->nifree = fs->su.ninodes;
+    memset(su->ntype, 0, sizeof su->ntype);
+    for (u32 i = 0; i < fs->su.nblock_inode; i++) {
+        itable_read(fs, i, &b);
+        itable_account(su, &b, 1);
+    }
+}
+
 /**
  * @brief Reads an inode from the disk into memory.
  * 
@@ -117,11 +674,17 @@ static int bitmap_free(u32 n)
  * @param p Pointer to the struct dinode where the read inode will be stored.
  * @return int Returns 0 on success, -1 on failure.
  */
-int read_inode(u32 n, struct dinode *p) 
+int read_inode(struct FileSystem *fs, u32 n, struct dinode *p) 
 {
     union block b;
+    fs_lock(fs, 0);
+    if (!fs->map)
+        pthread_mutex_lock(&fs->itlock);
     // Read a inode block to the buffer
-    disk_read(fs.su.sinode + n/NINODES_PER_BLOCK, &b);
+    itable_read(fs, n/NINODES_PER_BLOCK, &b);
+    if (!fs->map)
+        pthread_mutex_unlock(&fs->itlock);
+    fs_unlock(fs);
     // Read the target inode
     *p = b.inodes[n%NINODES_PER_BLOCK];
     return 0;
@@ -134,27 +697,46 @@ int read_inode(u32 n, struct dinode *p)
  * @param p Pointer to the struct dinode containing the inode to be written.
  * @return int Returns 0 on success, -1 on failure.
  */
-int write_inode(u32 n, struct dinode *p) 
+int write_inode(struct FileSystem *fs, u32 n, struct dinode *p) 
 {
     union block b;
-    disk_read(fs.su.sinode + n/NINODES_PER_BLOCK, &b);
+    if (fs->map)
+        return -1;
+    fs_lock(fs, 0);
+    pthread_mutex_lock(&fs->itlock);
+    itable_read(fs, n/NINODES_PER_BLOCK, &b);
     b.inodes[n%NINODES_PER_BLOCK] = *p;
-    disk_write(fs.su.sinode + n/NINODES_PER_BLOCK, &b);
+    itable_write(fs, n/NINODES_PER_BLOCK, &b);
+    pthread_mutex_unlock(&fs->itlock);
+    // Its block map may have changed along with it
+    bmcache_forget(fs, n);
+    fs_unlock(fs);
     return 0;
 }
 
 // Given a index into the 'ptrs' array in an inode,
 // this function returns the indirection level of the
 // pointer entry - if it's a direct, singly-indirect,
-// or a doubly-indirect pointer.
+// doubly-indirect or a triply-indirect pointer.
 static int get_ilevel(int ptr_idx) 
 {
     if (ptr_idx < NDIRECT)
         return 0;
     else if (ptr_idx < NDIRECT+NINDRECT)
         return 1;
-    else
+    else if (ptr_idx < NDIRECT+NINDRECT+NDINDRECT)
         return 2;
+    else
+        return 3;
+}
+
+// The number of data blocks covered by a block at a given ilevel
+static u32 ilevel_span(int ilevel)
+{
+    u32 span = 1;
+    while (ilevel--)
+        span *= NPTRS_PER_BLOCK;
+    return span;
 }
 
 // There are three types of blocks:
@@ -162,6 +744,7 @@ static int get_ilevel(int ptr_idx)
 // 1. Data blocks
 // 2. Singly-indirect blocks
 // 3. Doubly-indirect blocks
+// 4. Triply-indirect blocks
 //
 // We consider all these blocks to be *indirect* blocks
 // and distinguish them by their "indirect level," ilevel for short.
@@ -170,46 +753,60 @@ static int get_ilevel(int ptr_idx)
 // Data blocks:             ilevel=0
 // Singly-indirect blocks:  ilevel=1
 // Doubly-indirect blocks:  ilevel=2
+// Triply-indirect blocks:  ilevel=3
 
 // Frees a general indirect block (can be a data block if ilevel=0). Recursively
 // frees all sub-level blocks based on the ilevel value. For example, an initial
 // call with ilevel=2 for a doubly-indirect block will recursively free all
 // singly-indirect blocks and their respective data blocks.
-static int free_indirect(u32 n, int ilevel) 
+//
+// Freeing only drops one reference. A block still referenced by someone else
+// (a snapshot or a clone) stays, and so does everything below it, since the
+// sub-level blocks are owned by the block and not by each of its referrers.
+static int free_indirect(struct FileSystem *fs, u32 n, int ilevel) 
 {
-    // ilevel=0 is the base case: it is a data block
-    if (!ilevel) {
-        assert(bitmap_free(n));
+    // Still shared or a data block (ilevel=0): nothing more to do
+    if (ref_dec(fs, n) || !ilevel)
         return 0;
-    }
     // Not a data block. Then it must be an indirect block.
     // We treat doubly-indirect and singly-indirect blocks
     // the same since they are all just a block of pointers.
     union block b;
-    // Read the indirect block
-    disk_read(n, &b);
-    // Free the block after reading into memory
-    assert(!bitmap_free(n));
+    // Read the indirect block. Freeing does not touch its
+    // content, so we can still read it after the ref drop.
+    disk_read(fs, n, &b);
     // Recursively free all referenced sub-level blocks
     for (int i = 0; i < NPTRS_PER_BLOCK; i++)
         if (b.ptrs[i])
-            free_indirect(b.ptrs[i], ilevel - 1); // Decrement ilevel per recursion
+            free_indirect(fs, b.ptrs[i], ilevel - 1); // Decrement ilevel per recursion
     return 0;
 }
 
 // Free an inode. Also need to free all referenced data blocks.
-int free_inode(u32 n) 
+int free_inode(struct FileSystem *fs, u32 n) 
 {
     union block b;
     struct dinode di;
-    if (n >= fs.su.ninodes)
+    if (n >= fs->su.ninodes || fs->map)
         return -1;
-    read_inode(n, &di);
+    fs_lock(fs, 0);
+    pthread_rwlock_wrlock(&fs->ilock[n]);
+    cache_drop(fs, n);
+    read_inode(fs, n, &di);
+    if (di.type) {
+        pthread_mutex_lock(&fs->itlock);
+        fs->su.ntype[di.type]--;
+        fs->su.nifree++;
+        pthread_mutex_unlock(&fs->itlock);
+    }
     di.type = 0;
     for (int i = 0; i < NPTRS; i++)
         if (di.ptrs[i])
-            free_indirect(di.ptrs[i], get_ilevel(i));
-    write_inode(n, &di);
+            free_indirect(fs, di.ptrs[i], get_ilevel(i));
+    memset(di.ptrs, 0, sizeof di.ptrs);
+    write_inode(fs, n, &di);
+    pthread_rwlock_unlock(&fs->ilock[n]);
+    fs_unlock(fs);
     return 0;
 }
 
@@ -219,29 +816,37 @@ int free_inode(u32 n)
  * @param type The type of the inode to be allocated
  * @return u32 The inode number of the allocated inode, or -1 if allocation fails
  */
-u32 alloc_inode(u16 type) 
+u32 alloc_inode(struct FileSystem *fs, u16 type) 
 {
-    // Invalid inode type, return error
-    if (type > T_DEV)
+    u32 inum = -1;
+    // Invalid inode type or read-only, return error
+    if (!type || type > T_DEV || fs->map)
         return -1;
-    // Loop through all blocks for inode
-    for (int i = 0; i < fs.su.nblock_inode; i++) {
+    fs_lock(fs, 0);
+    pthread_mutex_lock(&fs->itlock);
+    // Loop through all blocks for inode, unless none is free
+    for (int i = 0; fs->su.nifree && inum == -1 && i < fs->su.nblock_inode; i++) {
         union block b;
         // Read current inode block to the buffer
-        disk_read(i + fs.su.sinode, &b);
+        itable_read(fs, i, &b);
         for (int j = 0; j < NINODES_PER_BLOCK; j++) {
             // Found a unallocated inode
             if (!b.inodes[j].type) {
                 struct dinode *p = &b.inodes[j];
                 memset(p, 0, sizeof(*p));
                 p->type = type;
+                fs->su.nifree--;
+                fs->su.ntype[type]++;
                 // Write back updated inode block
-                disk_write(i + fs.su.sinode, &b);
-                return i * NINODES_PER_BLOCK + j;
+                itable_write(fs, i, &b);
+                inum = i * NINODES_PER_BLOCK + j;
+                break;
             }
         }
     }
-    return -1;
+    pthread_mutex_unlock(&fs->itlock);
+    fs_unlock(fs);
+    return inum;
 }
 
 // This is the last argument of recursive_rw(), and the struct 
@@ -258,13 +863,109 @@ struct share_arg {
     // Note: For each block pointed to by pp, we test if the data block it covers
     // or itself if it is a data block (*boff + nblocks linked to it) overlaps with 
     // the [sblock, eblock] interval, and we skip this block if not.
-    u32 off;    // Same off in inode_rw()
+    // Logical block numbers fit in a u32 even with the triply-indirect pointer;
+    // byte offsets need not.
+    u64 off;    // Same off in inode_rw()
     char *buf;  // Same buf in inode_rw()
     u32 left;   // Number of bytes left
     int w;      // Recursive write? Recursive read if 0
+    int csum;   // Checksum the data blocks written
+    int dedup;  // Share full data blocks with identical existing ones
+    u32 goal;   // Preferred location of the next block allocated
+    int punch;  // With w set, free the data blocks in range instead of writing them
+    int nodata; // With w set, map the data blocks in range but leave their content alone
+    int noalloc; // Fail rather than allocate a missing block (I_CONTIG)
 };
 
 
+/**
+ * @brief Copy-on-write: give the caller a private copy of a shared block
+ * 
+ * If the block *pp points to is shared, copy it to a newly allocated block,
+ * make *pp point to the copy and drop the caller's reference to the original.
+ * When an indirect block is copied, each block it points to gains a referrer.
+ * 
+ * @param pp Pointer to the block pointer, which the caller must own exclusively.
+ * @param ilevel Indirection level of the block.
+ * @param goal Where the copy should preferably go (see bitmap_alloc()).
+ * @return int Returns 0 on success, -1 if out of blocks or references.
+ */
+static int block_unshare(struct FileSystem *fs, u32 *pp, int ilevel, u32 goal)
+{
+    union block b;
+    u32 nb;
+    if (ref_get(fs, *pp) == 1)
+        return 0;
+    disk_read(fs, *pp, &b);
+    if (ilevel) {
+        for (int i = 0; i < NPTRS_PER_BLOCK; i++) {
+            if (b.ptrs[i] && ref_inc(fs, b.ptrs[i])) {
+                while (i--)
+                    if (b.ptrs[i])
+                        ref_dec(fs, b.ptrs[i]);
+                return -1;
+            }
+        }
+    }
+    if (!(nb = bitmap_alloc(fs, goal))) {
+        if (ilevel)
+            for (int i = 0; i < NPTRS_PER_BLOCK; i++)
+                if (b.ptrs[i])
+                    ref_dec(fs, b.ptrs[i]);
+        return -1;
+    }
+    // The copy is checksummed if the original was
+    block_write(fs, nb, &b, ilevel || fs->csum[*pp]);
+    ref_dec(fs, *pp);
+    *pp = nb;
+    return 0;
+}
+
+/**
+ * @brief Point a data block pointer at existing data identical to 'buf'
+ * 
+ * A zero block becomes a hole. Otherwise the fingerprint index is searched
+ * for a block with the same content, which gains a reference.
+ * 
+ * @param pp Pointer to the data block pointer, which the caller must own exclusively.
+ * @param buf A full block of data about to be written.
+ * @return int Returns 0 if *pp now maps the data, -1 if it must be written.
+ */
+static int dedup_block(struct FileSystem *fs, u32 *pp, void *buf)
+{
+    static const u8 zeros[BLOCKSIZE];
+    union block b;
+    u32 fp;
+    if (!memcmp(buf, zeros, BLOCKSIZE)) {
+        if (*pp)
+            free_indirect(fs, *pp, 0);
+        *pp = 0;
+        return 0;
+    }
+    fp = dedup_fp(buf);
+    // The match must not be freed before we hold a reference to it
+    pthread_mutex_lock(&fs->alock);
+    int ret = -1;
+    for (u32 e = fs->fphead[fp % fs->nfpbucket]; e; e = fs->fpnext[e - 1]) {
+        u32 n = e - 1 + fs->su.sdata;
+        if (fs->fpval[e - 1] != fp)
+            continue;
+        disk_read(fs, n, &b);
+        if (memcmp(&b, buf, BLOCKSIZE))
+            continue;
+        if (n != *pp && !ref_inc(fs, n)) {
+            if (*pp)
+                free_indirect(fs, *pp, 0);
+            *pp = n;
+            fs->ndedup++;
+        }
+        ret = n == *pp ? 0 : -1;
+        break;
+    }
+    pthread_mutex_unlock(&fs->alock);
+    return ret;
+}
+
 /**
  * @brief Recursively writes data to disk blocks or indirect blocks.
  * 
@@ -274,6 +975,7 @@ struct share_arg {
  * @return int Returns 0 on success, -1 on failure.
  */
 static int recursive_rw(
+    struct FileSystem *fs,
     u32 *pp,    // Pointer to a block pointer (which could be in an inode or an indirect pointer that caller traverses)
     u32 ilevel, // Recursion level. 0 means we've reached a data block.
     struct share_arg *sa
@@ -281,72 +983,127 @@ static int recursive_rw(
     // Do we skip this indirect block?
     // Compute data *block coverage* of this indirect (or data) block: [sblock, eblock)
     u32 sblock = sa->boff;
-    u32 eblock = sa->boff;
-    if (ilevel == 0)
-        eblock += 1;
-    if (ilevel == 1)
-        eblock += NPTRS_PER_BLOCK;
-    if (ilevel == 2)
-        eblock += NPTRS_PER_BLOCK*NPTRS_PER_BLOCK;
+    u32 eblock = sa->boff + ilevel_span(ilevel);
     // Do [sblock, eblock) and [sa->sblock, sa->eblock], the *block coverage* of this w/r operation overlap?
     if (!(sblock <= sa->eblock && sa->sblock < eblock)) {
         sa->boff = eblock;
-        sa->off += (eblock - sblock) * BLOCKSIZE;
+        sa->off += (u64)(eblock - sblock) * BLOCKSIZE;
         return 0;
     }
-    if (sa->w) {
+    // Full data block writes may be satisfied by identical existing data
+    if (sa->w && sa->dedup && !ilevel && sa->off % BLOCKSIZE == 0 && sa->left >= BLOCKSIZE &&
+        !dedup_block(fs, pp, sa->buf)) {
+        sa->buf += BLOCKSIZE;
+        sa->left -= BLOCKSIZE;
+        sa->off += BLOCKSIZE;
+        sa->boff = eblock;
+        return 0;
+    }
+    int fresh = 0;
+    if (sa->w && !sa->punch) {
         // This indirect (or data) block is involved in this w/r,
         // so it should not be null and we should allocate it if null.
         int zero = 0;
         if (!*pp && ilevel)
             zero = 1;
-        if (!*pp && !(*pp = bitmap_alloc()))
+        fresh = !*pp;
+        if (!*pp && sa->noalloc)
+            return -1; // past the reserved blocks
+        if (!*pp && !(*pp = bitmap_alloc(fs, sa->goal)))
             return -1; // ran out of free blocks
+        // Shared with a snapshot? Copy before modifying.
+        if (!zero && block_unshare(fs, pp, ilevel, sa->goal))
+            return -1;
+        // What comes next in the file goes after this block. Existing indirect
+        // blocks don't count: the data they map is already laid out after them.
+        if (!ilevel || zero)
+            sa->goal = *pp + 1;
         if (zero) {
             char zeros[BLOCKSIZE] = {0};
-            disk_write(*pp, &zeros);
-        }
-    } else {
-        // Handle reading sparse files
-        if (!*pp) {
-            u32 sz = (eblock - sblock) * BLOCKSIZE;
-            if (sa->left < sz)
-                sz = sa->left;
+            disk_write(fs, *pp, &zeros);
+        }
+    } else if (!*pp) {
+        // Handle reading sparse files (and punching holes that already are)
+        u32 first = sblock > sa->sblock ? sblock : sa->sblock;
+        u64 sz = (u64)(eblock - first) * BLOCKSIZE - sa->off % BLOCKSIZE;
+        if (sa->left < sz)
+            sz = sa->left;
+        if (!sa->w)
             memset(sa->buf, 0, sz);
-            sa->buf += sz;
-            sa->left -= sz;
-            sa->off += sz;
+        sa->buf += sz;
+        sa->left -= sz;
+        sa->off += sz;
+        sa->boff = eblock;
+        return 0;
+    } else if (sa->punch) {
+        // Drop the data block, or make the indirect block ours to modify
+        if (!ilevel) {
+            free_indirect(fs, *pp, 0);
+            *pp = 0;
+            sa->buf += BLOCKSIZE;
+            sa->left -= BLOCKSIZE;
+            sa->off += BLOCKSIZE;
             sa->boff = eblock;
             return 0;
         }
+        if (block_unshare(fs, pp, ilevel, 0))
+            return -1;
     }
     union block b;
     // It is an indirect block, start recursion.
     if (ilevel) {
-        disk_read(*pp, &b);
-        for (int i = 0; i < NPTRS_PER_BLOCK; i++)
-            if (recursive_rw(&b.ptrs[i], ilevel - 1, sa)) {
+        // Go straight to the first sub-level block in range and stop after
+        // the last one, so that large offsets cost O(depth) rather than a
+        // scan of every pointer on the way.
+        u32 span = ilevel_span(ilevel - 1);
+        u32 first = sa->sblock > sblock ? (sa->sblock - sblock) / span : 0;
+        u32 last = (sa->eblock - sblock) / span;
+        if (last >= NPTRS_PER_BLOCK)
+            last = NPTRS_PER_BLOCK - 1;
+        sa->boff = sblock + first * span;
+        sa->off += (u64)first * span * BLOCKSIZE;
+        disk_read(fs, *pp, &b);
+        for (int i = first; i <= last; i++)
+            if (recursive_rw(fs, &b.ptrs[i], ilevel - 1, sa)) {
                 // If a write failed half way, we do *not* roll back, but
                 // leave the blocks already written and abort. However,
                 // we DO need to update the indirect block that has been
                 // modified. That's why we're writing back to disk this
                 // indirect block.
-                if (sa->w) disk_write(*pp, &b);
+                if (sa->w) disk_write(fs, *pp, &b);
                 return -1;
             }
-        disk_write(*pp, &b);
+        if (sa->w)
+            disk_write(fs, *pp, &b);
+        sa->boff = eblock;
         return 0;
     }
     // It's a data block.
     u32 start = sa->off % BLOCKSIZE;
     u32 sz = sa->left < (BLOCKSIZE - start) ? sa->left : (BLOCKSIZE - start);
-    disk_read(*pp, &b);
+    // Only mapping it: the caller writes it (see direct_rw())
+    if (sa->nodata) {
+        sa->left -= sz;
+        sa->off += sz;
+        sa->boff = eblock;
+        return 0;
+    }
+    u8 *data = b.bytes;
+    // A block just allocated holds stale data of its previous owner
+    if (fresh)
+        memset(&b, 0, sizeof b);
+    else if (fs->map)
+        data = disk_map(fs, *pp); // read-only: copied straight to the caller
+    else
+        disk_read(fs, *pp, &b);
     if (sa->w) {
         memcpy(&b.bytes[start], sa->buf, sz);
-        disk_write(*pp, &b);
+        block_write(fs, *pp, &b, sa->csum);
+        if (sa->dedup && sz == BLOCKSIZE)
+            dedup_insert(fs, *pp, dedup_fp(&b));
     } else
-        memcpy(sa->buf, &b.bytes[start], sz);
-    mylog(sa->w ? "write block: %d\n" : "read block: %d\n", *pp);
+        memcpy(sa->buf, &data[start], sz);
+    mylog(fs, sa->w ? "write block: %d\n" : "read block: %d\n", *pp);
     sa->buf += sz;
     sa->left -= sz;
     sa->off += sz;
@@ -356,177 +1113,2372 @@ static int recursive_rw(
 
 
 /**
- * @brief Writes data to an inode within the file system.
+ * @brief Read or write the blocks mapped by an in-memory inode
  * 
- * @param n The inode number representing the inode to which data will be written.
- * @param buf A pointer to the buffer containing the data to be written.
- * @param sz The size of the data to be written.
- * @param off The offset where the writing should start.
- * @return int Returns 0 if the write operation is successful, otherwise returns -1.
+ * This works on the raw block map: it neither looks at nor updates the inode
+ * size, and it does not write the inode back. Holes read as zeros.
+ * 
+ * @param di The inode, whose block pointers are updated by writes.
+ * @param buf The data buffer.
+ * @param sz The number of bytes to be transferred.
+ * @param off The byte offset where the transfer starts.
+ * @param w Write if set, read otherwise.
+ * @param goal Where to allocate if the block before 'off' is not mapped.
+ * @return u32 The number of bytes transferred.
  */
-static u32 inode_rw(u32 n, void *buf, u32 sz, u32 off, int w)
+static u32 blocks_rw(struct FileSystem *fs, struct dinode *di, void *buf, u32 sz, u64 off, int w, u32 goal)
 {
-    struct dinode di;
-    u32 sbyte = off;
-    u32 ebyte = off + sz;
-    // Invalid inode number
-    if (n >= fs.su.ninodes)
-        return -1;
-    // Read inode structure
-    if (read_inode(n, &di))
-        return -1;
-    if (!w && sbyte >= di.size)
+    if (!sz)
         return 0;
-    if (!w && ebyte >= di.size) {
-        ebyte = di.size;
-        sz = di.size - sbyte;
-    }
-    u32 sblock = sbyte/BLOCKSIZE;
-    u32 eblock = ebyte/BLOCKSIZE;
+    // New blocks preferably follow the file's preceding block
+    u32 prev = w && off >= BLOCKSIZE ? bmap(fs, di, off/BLOCKSIZE - 1) : 0;
     struct share_arg *sa = &(struct share_arg){
         .boff = 0,
-        .sblock = sblock,
-        .eblock = eblock,
+        .sblock = off/BLOCKSIZE,
+        .eblock = (off + sz - 1)/BLOCKSIZE,
         .off = off,
         .buf = buf,
         .left = sz,
-        .w = w
+        .w = w,
+        .csum = di->type == T_DIR || (fs->su.features & FEAT_CSUM_DATA),
+        // Compressed clusters rely on which of their blocks are holes,
+        // and contiguous files on their blocks staying in place, so only
+        // plain regular files are deduplicated
+        .dedup = w && fs->fpval && di->type == T_REG && !(di->flags & (I_COMPRESSED | I_CONTIG)),
+        .goal = prev ? prev + 1 : goal,
+        .noalloc = di->type == T_REG && (di->flags & I_CONTIG)
     };
+    for (int i = 0; i < NPTRS; i++)
+        if (recursive_rw(fs, &di->ptrs[i], get_ilevel(i), sa))
+            break;
+    return sz - sa->left;
+}
+
+// Free the 'nblock' data blocks starting at logical block 'sblock'
+static void blocks_punch(struct FileSystem *fs, struct dinode *di, u32 sblock, u32 nblock)
+{
+    if (!nblock)
+        return;
+    struct share_arg *sa = &(struct share_arg){
+        .boff = 0,
+        .sblock = sblock,
+        .eblock = sblock + nblock - 1,
+        .off = (u64)sblock * BLOCKSIZE,
+        .left = nblock * BLOCKSIZE,
+        .w = 1,
+        .punch = 1
+    };
+    for (int i = 0; i < NPTRS; i++)
+        if (recursive_rw(fs, &di->ptrs[i], get_ilevel(i), sa))
+            break;
+}
 
+// Make sure the 'nblock' blocks from logical block 'sblock' on are mapped and
+// not shared, allocating them as blocks_rw() would, but without writing them.
+// Return the number of blocks mapped.
+static u32 blocks_map(struct FileSystem *fs, struct dinode *di, u32 sblock, u32 nblock, u32 goal)
+{
+    if (!nblock)
+        return 0;
+    u32 prev = sblock ? bmap(fs, di, sblock - 1) : 0;
+    struct share_arg *sa = &(struct share_arg){
+        .boff = 0,
+        .sblock = sblock,
+        .eblock = sblock + nblock - 1,
+        .off = (u64)sblock * BLOCKSIZE,
+        .left = nblock * BLOCKSIZE,
+        .w = 1,
+        .nodata = 1,
+        .goal = prev ? prev + 1 : goal,
+        .noalloc = di->type == T_REG && (di->flags & I_CONTIG)
+    };
     for (int i = 0; i < NPTRS; i++)
-        if (recursive_rw(&di.ptrs[i], get_ilevel(i), sa))
+        if (recursive_rw(fs, &di->ptrs[i], get_ilevel(i), sa))
+            break;
+    return nblock - sa->left / BLOCKSIZE;
+}
+
+// Direct I/O
+//
+// With fs_direct() on, large transfers of whole blocks to and from plain
+// regular files skip both the host page cache and the block buffers of
+// recursive_rw(): each physically contiguous run of the file is read or
+// written with one request on an O_DIRECT descriptor, straight from or to
+// the caller's buffer. A device that wants more alignment than the request
+// has gets it through the cached descriptor instead. Metadata, including
+// the checksums and the indirect blocks mapping the data, still goes
+// through the cached path.
+
+#define DIRECT_MIN (16 * BLOCKSIZE) // Smaller transfers are not worth a trip to the device
+
+static int direct_ok(struct FileSystem *fs, struct dinode *di, void *buf, u32 sz, u64 off)
+{
+    // Deduplication and compression need to see the data
+    return fs->dvd >= 0 && di->type == T_REG && !(di->flags & I_COMPRESSED) && !fs->fpval &&
+           sz >= DIRECT_MIN && off % BLOCKSIZE == 0 && (uintptr_t)buf % BLOCKSIZE == 0;
+}
+
+// Transfer 'cnt' blocks between 'buf' and the image from block 'n' on
+static int direct_xfer(struct FileSystem *fs, void *buf, u32 n, u32 cnt, int w)
+{
+    size_t len = (size_t)cnt * BLOCKSIZE;
+    off_t o = (off_t)n * BLOCKSIZE;
+    iostat_add(w ? &fs->nbwritten : &fs->nbread, cnt);
+    if ((w ? pwrite(fs->dvd, buf, len, o) : pread(fs->dvd, buf, len, o)) == len)
+        return 0;
+    return (w ? pwrite(fs->vd, buf, len, o) : pread(fs->vd, buf, len, o)) == len ? 0 : -1;
+}
+
+// After a failed direct write, give blocks i to nblock of the request that
+// blocks_map() mapped anew what they held before: zeros for a hole, the
+// shared block's data for a copy. 'old' has what each block mapped to before.
+static void direct_restore(struct FileSystem *fs, struct dinode *di, u32 sblock, u32 i, u32 nblock, u32 *old, int csum)
+{
+    union block b;
+    for (; i < nblock; i++) {
+        u32 n = bmap(fs, di, sblock + i);
+        if (n == old[i])
+            continue;
+        if (old[i])
+            block_read(fs, old[i], &b);
+        else
+            memset(&b, 0, BLOCKSIZE);
+        block_write(fs, n, &b, csum);
+    }
+}
+
+/**
+ * @brief Read or write the whole blocks of a request directly (see direct_ok())
+ * 
+ * Like blocks_rw(), this neither looks at nor updates the inode size. Writes
+ * map all the blocks first; if a transfer fails, those newly mapped and not
+ * written yet are given back their previous contents (see direct_restore()).
+ * 
+ * @return u32 The number of bytes transferred, a multiple of BLOCKSIZE.
+ */
+static u32 direct_rw(struct FileSystem *fs, struct dinode *di, char *buf, u32 sz, u64 off, int w, u32 goal)
+{
+    u32 sblock = off / BLOCKSIZE;
+    u32 nblock = sz / BLOCKSIZE;
+    int csum = !!(fs->su.features & FEAT_CSUM_DATA);
+    u32 *old = 0;
+    if (w) {
+        assert((old = malloc(nblock * sizeof(u32))));
+        for (u32 k = 0; k < nblock; k++)
+            old[k] = bmap(fs, di, sblock + k);
+        nblock = blocks_map(fs, di, sblock, nblock, goal);
+    }
+    u32 i = 0;
+    while (i < nblock) {
+        u32 n = bmap(fs, di, sblock + i);
+        u32 cnt = 1;
+        while (i + cnt < nblock && bmap(fs, di, sblock + i + cnt) == (n ? n + cnt : 0))
+            cnt++;
+        char *p = buf + (size_t)i * BLOCKSIZE;
+        if (!n) {
+            // A hole, only read (writes mapped every block)
+            memset(p, 0, (size_t)cnt * BLOCKSIZE);
+        } else if (direct_xfer(fs, p, n, cnt, w)) {
+            if (w)
+                direct_restore(fs, di, sblock, i, nblock, old, csum);
+            break;
+        } else {
+            mylog(fs, "direct %s: %u blocks at %u\n", w ? "write" : "read", cnt, n);
+            for (u32 k = 0; k < cnt; k++) {
+                if (w) {
+                    cbt_mark(fs, n + k);
+                    csum_update(fs, n + k, csum ? block_csum(p + k * BLOCKSIZE) : 0);
+                } else if (csum_verify(fs, n + k, p + k * BLOCKSIZE)) {
+                    fprintf(stderr, "checksum mismatch on block %u\n", n + k);
+                    exit(1);
+                }
+            }
+        }
+        i += cnt;
+    }
+    free(old);
+    return i * BLOCKSIZE;
+}
+
+// Walk the block map down to logical block 'lblock'. If the walk ends in an
+// indirect block of the last level, leave it in 'b' and the index of the
+// pointer to lblock in *slot, else set *slot to -1.
+static u32 bmap_walk(struct FileSystem *fs, struct dinode *di, u32 lblock, union block *b, int *slot)
+{
+    u32 span = 1;
+    int i;
+    *slot = -1;
+    // Find the root pointer covering lblock
+    for (i = 0; i < NPTRS; i++) {
+        span = ilevel_span(get_ilevel(i));
+        if (lblock < span)
             break;
-    u32 consumed = sz - sa->left;
+        lblock -= span;
+    }
+    if (i == NPTRS)
+        return 0;
+    u32 p = di->ptrs[i];
+    // Walk down one level at a time
+    for (int l = get_ilevel(i); l && p; l--) {
+        span /= NPTRS_PER_BLOCK;
+        disk_read(fs, p, b);
+        p = b->ptrs[lblock / span];
+        *slot = l == 1 ? (int)(lblock / span) : -1;
+        lblock %= span;
+    }
+    return p;
+}
+
+/**
+ * @brief Translate a logical block of an inode to its data block
+ * 
+ * Only the pointers on the path to the block are visited.
+ * 
+ * @param di The inode.
+ * @param lblock The logical block number within the file.
+ * @return u32 The data block number, or 0 if the block is a hole.
+ */
+static u32 bmap(struct FileSystem *fs, struct dinode *di, u32 lblock)
+{
+    union block b;
+    int slot;
+    return bmap_walk(fs, di, lblock, &b, &slot);
+}
+
+// Block map cache
+//
+// Reads of regular files and directories translate each logical block with
+// bmap_cached(), which remembers recent translations, holes included, in a
+// small direct-mapped table shared by all inodes. A miss walks the block map
+// like bmap() and caches every pointer of the last indirect block read, so
+// a file is walked once per NPTRS_PER_BLOCK blocks and repeated random reads
+// cost only their data blocks. Entries of an inode are invalidated all at
+// once by bumping its generation in write_inode(), through which every
+// change to a block map ends up; a rollback, which rewrites the inode table
+// directly, clears the whole cache. Read-only mounts,
+// whose block maps don't change and whose readers take no locks, go without.
+
+static void bmcache_init(struct FileSystem *fs)
+{
+    assert((fs->bmcache = malloc(NBMCACHE * sizeof(struct bmcache_ent))));
+    assert((fs->mgen = calloc(fs->su.ninodes, sizeof(u32))));
+    for (int i = 0; i < NBMCACHE; i++)
+        fs->bmcache[i].lblock = ~0u;
+}
+
+static struct bmcache_ent *bmcache_slot(struct FileSystem *fs, u32 n, u32 lblock)
+{
+    return &fs->bmcache[(n * 2654435761u ^ lblock) % NBMCACHE];
+}
+
+// Forget the cached mappings of inode n
+static void bmcache_forget(struct FileSystem *fs, u32 n)
+{
+    if (!fs->bmcache)
+        return;
+    pthread_mutex_lock(&fs->mlock);
+    fs->mgen[n]++;
+    pthread_mutex_unlock(&fs->mlock);
+}
+
+// Forget every cached mapping. The caller holds fs->lock exclusively.
+static void bmcache_clear(struct FileSystem *fs)
+{
+    if (!fs->bmcache)
+        return;
+    pthread_mutex_lock(&fs->mlock);
+    for (int i = 0; i < NBMCACHE; i++)
+        fs->bmcache[i].lblock = ~0u;
+    pthread_mutex_unlock(&fs->mlock);
+}
+
+/**
+ * @brief Map a logical block of inode n like bmap(), through the block map cache
+ * 
+ * The caller holds the inode, at least shared.
+ */
+static u32 bmap_cached(struct FileSystem *fs, u32 n, struct dinode *di, u32 lblock)
+{
+    union block b;
+    int slot;
+    if (lblock < NDIRECT || !fs->bmcache)
+        return bmap(fs, di, lblock);
+    pthread_mutex_lock(&fs->mlock);
+    struct bmcache_ent *e = bmcache_slot(fs, n, lblock);
+    int hit = e->inum == n && e->lblock == lblock && e->gen == fs->mgen[n];
+    u32 p = e->pblock;
+    pthread_mutex_unlock(&fs->mlock);
+    if (hit)
+        return p;
+    p = bmap_walk(fs, di, lblock, &b, &slot);
+    pthread_mutex_lock(&fs->mlock);
+    if (slot < 0)
+        *bmcache_slot(fs, n, lblock) = (struct bmcache_ent){ n, lblock, p, fs->mgen[n] };
+    else {
+        // The neighbours mapped by the same indirect block come for free
+        u32 first = lblock - slot;
+        for (u32 i = 0; i < NPTRS_PER_BLOCK; i++)
+            *bmcache_slot(fs, n, first + i) = (struct bmcache_ent){ n, first + i, b.ptrs[i], fs->mgen[n] };
+    }
+    pthread_mutex_unlock(&fs->mlock);
+    return p;
+}
+
+/**
+ * @brief Read the blocks mapped by inode n, one block at a time through bmap_cached()
+ * 
+ * Like blocks_rw() reading, but without walking the block map again for
+ * each call. The caller holds the inode, at least shared.
+ * 
+ * @return u32 The number of bytes read.
+ */
+static u32 blocks_read(struct FileSystem *fs, u32 n, struct dinode *di, void *buf, u32 sz, u64 off)
+{
+    union block b;
+    char *dst = buf;
+    for (u64 pos = off; pos < off + sz;) {
+        u32 start = pos % BLOCKSIZE;
+        u32 len = off + sz - pos < BLOCKSIZE - start ? off + sz - pos : BLOCKSIZE - start;
+        u32 p = bmap_cached(fs, n, di, pos / BLOCKSIZE);
+        if (!p)
+            memset(dst, 0, len);
+        else if (len == BLOCKSIZE)
+            disk_read(fs, p, dst);
+        else {
+            disk_read(fs, p, &b);
+            memcpy(dst, &b.bytes[start], len);
+        }
+        if (p)
+            mylog(fs, "read block: %d\n", p);
+        dst += len;
+        pos += len;
+    }
+    return sz;
+}
+
+// Compressed files
+//
+// A compressed file is split into clusters of NCLUSTER_BLOCKS logical blocks,
+// each compressed on its own with the LZ codec. A compressed cluster starts
+// with a u16 holding its compressed size and is stored in the first blocks of
+// the cluster's own logical range, leaving the remaining ones as holes. The
+// block map therefore doubles as the cluster index: any cluster can be found
+// and decompressed without touching the others. A cluster that does not
+// shrink by at least a block is stored as is, filling all its blocks, and an
+// all-zero cluster is left as a hole.
+#define NCLUSTER_BLOCKS 8
+#define CLUSTERSIZE     (NCLUSTER_BLOCKS*BLOCKSIZE)
+
+// Read and decompress cluster 'c' into 'plain'
+static int cluster_read(struct FileSystem *fs, struct dinode *di, u32 c, u8 *plain)
+{
+    u8 raw[CLUSTERSIZE];
+    u16 clen;
+    u32 sblock = c * NCLUSTER_BLOCKS;
+    if (!bmap(fs, di, sblock)) {
+        memset(plain, 0, CLUSTERSIZE);
+        return 0;
+    }
+    // Stored as is?
+    if (bmap(fs, di, sblock + NCLUSTER_BLOCKS - 1))
+        return blocks_rw(fs, di, plain, CLUSTERSIZE, (u64)c * CLUSTERSIZE, 0, 0) == CLUSTERSIZE ? 0 : -1;
+    blocks_rw(fs, di, raw, CLUSTERSIZE, (u64)c * CLUSTERSIZE, 0, 0);
+    memcpy(&clen, raw, sizeof clen);
+    if (clen > CLUSTERSIZE - sizeof clen)
+        return -1;
+    return lz_decompress(raw + sizeof clen, clen, plain, CLUSTERSIZE) == CLUSTERSIZE ? 0 : -1;
+}
+
+// Compress 'plain' and store it as cluster 'c'
+static int cluster_write(struct FileSystem *fs, struct dinode *di, u32 c, u8 *plain, u32 goal)
+{
+    u8 raw[CLUSTERSIZE] = {0};
+    u16 clen = 0;
+    u32 k = NCLUSTER_BLOCKS;
+    int zero = 1;
+    for (int i = 0; i < CLUSTERSIZE && zero; i++)
+        zero = !plain[i];
+    if (zero)
+        k = 0;
+    else if ((clen = lz_compress(plain, CLUSTERSIZE, raw + sizeof clen,
+                                 (NCLUSTER_BLOCKS - 1) * BLOCKSIZE - sizeof clen))) {
+        memcpy(raw, &clen, sizeof clen);
+        k = (clen + sizeof clen + BLOCKSIZE - 1) / BLOCKSIZE;
+    } else
+        memcpy(raw, plain, CLUSTERSIZE);
+    if (blocks_rw(fs, di, raw, k * BLOCKSIZE, (u64)c * CLUSTERSIZE, 1, goal) != k * BLOCKSIZE)
+        return -1;
+    blocks_punch(fs, di, c * NCLUSTER_BLOCKS + k, NCLUSTER_BLOCKS - k);
+    return 0;
+}
+
+// inode_rw() for compressed files: transfer whole clusters through a buffer
+static u32 cluster_rw(struct FileSystem *fs, struct dinode *di, char *buf, u32 sz, u64 off, int w, u32 goal)
+{
+    u8 plain[CLUSTERSIZE];
+    u32 done = 0;
+    while (done < sz) {
+        u32 c = (off + done) / CLUSTERSIZE;
+        u32 start = (off + done) % CLUSTERSIZE;
+        u32 len = sz - done < CLUSTERSIZE - start ? sz - done : CLUSTERSIZE - start;
+        // A write covering the whole cluster doesn't need the old content
+        if ((!w || len < CLUSTERSIZE) && cluster_read(fs, di, c, plain))
+            break;
+        if (!w)
+            memcpy(buf + done, plain + start, len);
+        else {
+            memcpy(plain + start, buf + done, len);
+            if (cluster_write(fs, di, c, plain, goal))
+                break;
+        }
+        done += len;
+    }
+    return done;
+}
+
+/**
+ * @brief Writes data to an inode within the file system.
+ * 
+ * @param n The inode number representing the inode to which data will be written.
+ * @param buf A pointer to the buffer containing the data to be written.
+ * @param sz The size of the data to be written.
+ * @param off The offset where the writing should start.
+ * @return int Returns 0 if the write operation is successful, otherwise returns -1.
+ */
+static u32 inode_rw(struct FileSystem *fs, u32 n, void *buf, u32 sz, u64 off, int w)
+{
+    struct dinode di;
+    u64 sbyte = off;
+    u64 ebyte = off + sz;
+    u32 consumed;
+    // Invalid inode number
+    if (n >= fs->su.ninodes)
+        return -1;
+    // Past what the block pointers can map, logical block numbers would wrap
+    if (w && (off > MAXFILE_BYTES || sz > MAXFILE_BYTES - off))
+        return -1;
+    // Read inode structure
+    if (read_inode(fs, n, &di))
+        return -1;
+    if (!w && sbyte >= di.size)
+        return 0;
+    if (!w && ebyte >= di.size) {
+        ebyte = di.size;
+        sz = di.size - sbyte;
+    }
+    if (di.type == T_REG && (di.flags & I_COMPRESSED))
+        consumed = cluster_rw(fs, &di, buf, sz, off, w, fs->hint[n]);
+    else if (direct_ok(fs, &di, buf, sz, off)) {
+        // Whole blocks directly, then the partial one at the end if any
+        consumed = direct_rw(fs, &di, buf, sz, off, w, fs->hint[n]);
+        if (consumed == sz / BLOCKSIZE * BLOCKSIZE)
+            consumed += blocks_rw(fs, &di, (char *)buf + consumed, sz - consumed, off + consumed, w, fs->hint[n]);
+    } else if (!w && !fs->map)
+        consumed = blocks_read(fs, n, &di, buf, sz, off);
+    else
+        consumed = blocks_rw(fs, &di, buf, sz, off, w, fs->hint[n]);
     ebyte = off + consumed; // ebyte should remain unchanged if consumed equals sz, 
                             // indicating that the required amount of bytes has been successfully 
                             // consumed from buf (write) or from disk (read)
     di.size = di.size > ebyte ? di.size : ebyte; // update inode size in case it's a write operation
-    if (w) {
-        assert(!write_inode(n, &di)); // update inode
-        fs_checker();
-    }
+    if (w)
+        assert(!write_inode(fs, n, &di)); // update inode
     return consumed;
 }
 
-u32 inode_write(u32 n, void *buf, u32 sz, u32 off) {
-    return inode_rw(n, buf, sz, off, 1);
+// Delayed allocation
+//
+// Writes to regular files land in dirty pages tied to the inode instead of
+// going to disk. No data block is chosen for them until the pages are
+// flushed (inode_flush()), when the whole dirty range is known: it is then
+// written out of a single run reserved for it, so it ends up contiguous. A
+// file deleted before its pages are flushed never touches the data blocks.
+// The inode size is updated right away. Pages are flushed in the background
+// (see "Writeback" below), by fs_sync() and fs_fsync(), when the cache fills
+// up (only those of the inode being written), and before any operation that
+// walks the block maps (snapshots, clones, defrag).
+//
+// A page that will need a new block when flushed is counted against the free
+// blocks as soon as it is dirtied (cache_reserve()), with the indirect blocks
+// it may need, so that a full disk fails the write rather than the flush.
+// When no room is left for it, the block is written through instead, which
+// allocates it right away or fails. Only flushes use the blocks held back.
+
+static void cache_init(struct FileSystem *fs)
+{
+    assert((fs->pages = malloc(NPAGES * sizeof(struct page))));
+    assert((fs->npages = calloc(fs->su.ninodes, sizeof(u16))));
+    assert((fs->nneed = calloc(fs->su.ninodes, sizeof(u16))));
+    assert((fs->wberr = calloc(fs->su.ninodes, 1)));
+    for (int i = 0; i < NPAGES; i++) {
+        fs->pbucket[i] = -1;
+        fs->pages[i].inum = 0;
+        fs->pages[i].next = i + 1 < NPAGES ? i + 1 : -1;
+    }
+    fs->pfree = 0;
+}
+
+static u64 now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u64)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int page_hash(u32 n, u32 lblock)
+{
+    return (n * 2654435761u ^ lblock) % NPAGES;
+}
+
+// Callers of the page_*() functions hold fs->plock. The data of a page
+// is protected by the lock of the inode it belongs to.
+
+static struct page *page_lookup(struct FileSystem *fs, u32 n, u32 lblock)
+{
+    for (int i = fs->pbucket[page_hash(n, lblock)]; i >= 0; i = fs->pages[i].next)
+        if (fs->pages[i].inum == n && fs->pages[i].lblock == lblock)
+            return &fs->pages[i];
+    return 0;
+}
+
+// Take a free page for block 'lblock' of inode n, or return 0 if the cache is full
+static struct page *page_add(struct FileSystem *fs, u32 n, u32 lblock)
+{
+    int i = fs->pfree;
+    if (i < 0)
+        return 0;
+    struct page *p = &fs->pages[i];
+    int h = page_hash(n, lblock);
+    fs->pfree = p->next;
+    p->inum = n;
+    p->lblock = lblock;
+    p->dirtied = now_ms();
+    p->next = fs->pbucket[h];
+    fs->pbucket[h] = i;
+    fs->npages[n]++;
+    fs->nused++;
+    return p;
+}
+
+static void page_remove(struct FileSystem *fs, struct page *p)
+{
+    int i = p - fs->pages;
+    int *pi = &fs->pbucket[page_hash(p->inum, p->lblock)];
+    while (*pi != i)
+        pi = &fs->pages[*pi].next;
+    *pi = p->next;
+    fs->npages[p->inum]--;
+    fs->nused--;
+    p->inum = 0;
+    p->next = fs->pfree;
+    fs->pfree = i;
+}
+
+// Blocks a flush of k unallocated pages may take, indirect blocks included.
+// This assumes the pages are mostly consecutive: scattered ones, each under
+// an indirect block of its own, can take more, and their flush then fails
+// like any other (see fs_fsync()).
+static u32 resv_blocks(u32 k)
+{
+    return k ? k + k / NPTRS_PER_BLOCK + 3 : 0;
+}
+
+// Does block 'lblock' of the file need a new block when written? It does
+// if it is a hole, or if it or any indirect block above it is shared, since
+// copying a shared indirect block shares what it points to.
+static int block_needed(struct FileSystem *fs, struct dinode *di, u32 lblock)
+{
+    union block b;
+    u32 span = 1;
+    int i;
+    for (i = 0; i < NPTRS; i++) {
+        span = ilevel_span(get_ilevel(i));
+        if (lblock < span)
+            break;
+        lblock -= span;
+    }
+    if (i == NPTRS)
+        return 1;
+    u32 p = di->ptrs[i];
+    for (int l = get_ilevel(i); ; l--) {
+        if (!p || ref_get(fs, p) > 1)
+            return 1;
+        if (!l)
+            return 0;
+        span /= NPTRS_PER_BLOCK;
+        disk_read(fs, p, &b);
+        p = b.ptrs[lblock / span];
+        lblock %= span;
+    }
+}
+
+// Count k more (or, if negative, fewer) pages of inode n as needing a block.
+// Returns -1, counting none, if the free blocks cannot cover them.
+static int cache_reserve(struct FileSystem *fs, u32 n, int k)
+{
+    int ret = 0;
+    pthread_mutex_lock(&fs->alock);
+    u32 old = resv_blocks(fs->nneed[n]);
+    u32 new = resv_blocks(fs->nneed[n] + k);
+    if (new > old && fs->su.nfree < fs->nreserved + (new - old))
+        ret = -1;
+    else {
+        fs->nreserved = fs->nreserved + new - old;
+        fs->nneed[n] += k;
+    }
+    pthread_mutex_unlock(&fs->alock);
+    return ret;
+}
+
+// Discard the cached pages of inode n without writing them
+static void cache_drop(struct FileSystem *fs, u32 n)
+{
+    if (!fs->npages)
+        return;
+    cache_reserve(fs, n, -fs->nneed[n]);
+    fs->wberr[n] = 0;
+    pthread_mutex_lock(&fs->plock);
+    for (int i = 0; fs->npages[n] && i < NPAGES; i++)
+        if (fs->pages[i].inum == n)
+            page_remove(fs, &fs->pages[i]);
+    pthread_mutex_unlock(&fs->plock);
+}
+
+static int page_cmp(const void *a, const void *b)
+{
+    u32 x = (*(struct page **)a)->lblock;
+    u32 y = (*(struct page **)b)->lblock;
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * @brief Write the cached pages of an inode to disk
+ * 
+ * A run large enough for the unallocated pages and the indirect blocks they
+ * may need is reserved first, right after the block preceding the first
+ * page, and bitmap_alloc() serves the flush out of it. Whatever is left of
+ * the run is released afterwards. Pages that could not be written stay in
+ * the cache, and the failure is recorded for fs_fsync() or fs_sync() to
+ * report, whoever flushed them. The caller holds the inode exclusively.
+ * 
+ * @param n The inode number
+ * @return int Returns 0 on success, -1 if some pages could not be written.
+ */
+static int inode_flush(struct FileSystem *fs, u32 n)
+{
+    struct dinode di;
+    struct page *list[NPAGES];
+    u32 cnt = 0;
+    u32 need = 0;
+    int ret = 0;
+    if (!fs->npages[n])
+        return 0;
+    pthread_mutex_lock(&fs->plock);
+    for (int i = 0; i < NPAGES; i++)
+        if (fs->pages[i].inum == n)
+            list[cnt++] = &fs->pages[i];
+    pthread_mutex_unlock(&fs->plock);
+    qsort(list, cnt, sizeof list[0], page_cmp);
+    read_inode(fs, n, &di);
+    for (u32 i = 0; i < cnt; i++)
+        need += !bmap(fs, &di, list[i]->lblock);
+    // The run below takes the place of what cache_write() held back
+    cache_reserve(fs, n, -fs->nneed[n]);
+    if (need) {
+        u32 prev = list[0]->lblock ? bmap(fs, &di, list[0]->lblock - 1) : 0;
+        u32 goal = prev ? prev + 1 : fs->hint[n];
+        u32 len = resv_blocks(need);
+        pthread_mutex_lock(&fs->alock);
+        u32 start = bitmap_find_run(fs, len, goal);
+        if (!start)
+            start = bitmap_find_run(fs, len = need, goal);
+        if (start) {
+            bitmap_alloc_run(fs, start, len);
+            resv = start;
+            nresv = len;
+        }
+        pthread_mutex_unlock(&fs->alock);
+    }
+    // Write each range of consecutive pages with one call, not past the end of the file
+    char *buf = malloc(cnt * BLOCKSIZE);
+    assert(buf);
+    for (u32 i = 0, j; i < cnt; i = j) {
+        for (j = i + 1; j < cnt && list[j]->lblock == list[j-1]->lblock + 1; j++);
+        u64 off = (u64)list[i]->lblock * BLOCKSIZE;
+        u64 end = (u64)(list[j-1]->lblock + 1) * BLOCKSIZE;
+        end = end < di.size ? end : di.size;
+        for (u32 k = i; k < j; k++)
+            memcpy(buf + (k - i) * BLOCKSIZE, list[k]->data, BLOCKSIZE);
+        u32 got = end > off ? inode_rw(fs, n, buf, end - off, off, 1) : 0;
+        if (end > off && got != end - off) {
+            got = got == (u32)-1 ? 0 : got;
+            mylog(fs, "flush of inode %u failed at offset %llu\n", n, (unsigned long long)(off + got));
+            fs->wberr[n] = 1;
+            ret = -1;
+            // Keep the pages not written, for a later flush to retry
+            for (u32 k = i + got / BLOCKSIZE; k < j; k++)
+                list[k] = 0;
+        }
+    }
+    free(buf);
+    pthread_mutex_lock(&fs->plock);
+    for (u32 i = 0; i < cnt; i++)
+        if (list[i])
+            page_remove(fs, list[i]);
+    pthread_mutex_unlock(&fs->plock);
+    while (nresv) {
+        nresv--;
+        ref_dec(fs, resv++);
+    }
+    return ret;
+}
+
+// Flush every inode and return how many had pages.
+// The caller holds fs->lock exclusively.
+static int sync_all(struct FileSystem *fs)
+{
+    int cnt = 0;
+    for (u32 n = 0; fs->npages && n < fs->su.ninodes; n++) {
+        cnt += !!fs->npages[n];
+        inode_flush(fs, n);
+    }
+    return cnt;
+}
+
+// Writeback
+//
+// A thread started at mount time writes the pages back without anyone
+// waiting on it, so that most writes only copy into the cache. Every so
+// often it flushes the files whose oldest page is older than fs->flush_age;
+// and once fs->flush_ratio % of the cache is in use, which cache_write()
+// wakes it up for, it also flushes the files with the oldest pages until the
+// use is back under half of that. Each file is flushed as a whole, under the
+// same locks as a write to it, so the flusher is just another writer.
+
+struct wb_file {
+    u32 inum;
+    u64 dirtied;            // Of its oldest page
+};
+
+static int wb_cmp(const void *a, const void *b)
+{
+    u64 x = ((struct wb_file *)a)->dirtied;
+    u64 y = ((struct wb_file *)b)->dirtied;
+    return x < y ? -1 : x > y;
+}
+
+// Flush the files due, oldest first. The caller holds fs->plock.
+static void writeback(struct FileSystem *fs)
+{
+    struct wb_file files[NPAGES];
+    u32 cnt = 0;
+    u32 nflushed = 0;
+    for (int i = 0; i < NPAGES; i++) {
+        struct page *p = &fs->pages[i];
+        u32 j;
+        if (!p->inum)
+            continue;
+        for (j = 0; j < cnt && files[j].inum != p->inum; j++);
+        if (j == cnt)
+            files[cnt++] = (struct wb_file){ p->inum, p->dirtied };
+        else if (p->dirtied < files[j].dirtied)
+            files[j].dirtied = p->dirtied;
+    }
+    qsort(files, cnt, sizeof files[0], wb_cmp);
+    u64 now = now_ms();
+    int over = fs->nused * 100 >= fs->flush_ratio * NPAGES;
+    for (u32 i = 0; i < cnt && !fs->fstop; i++) {
+        // Past the ratio, down to half of it
+        int full = over && fs->nused * 200 >= fs->flush_ratio * NPAGES;
+        if (now - files[i].dirtied < fs->flush_age && !full)
+            break;
+        pthread_mutex_unlock(&fs->plock);
+        u32 n = files[i].inum;
+        fs_lock(fs, 0);
+        pthread_rwlock_wrlock(&fs->ilock[n]);
+        u32 npages = fs->npages[n];
+        inode_flush(fs, n);
+        pthread_rwlock_unlock(&fs->ilock[n]);
+        fs_unlock(fs);
+        mylog(fs, "writeback: inode %u, %u pages (%s)\n", n, npages, full ? "ratio" : "age");
+        nflushed += !!npages;
+        pthread_mutex_lock(&fs->plock);
+    }
+    if (nflushed) {
+        pthread_mutex_unlock(&fs->plock);
+        fs_check(fs);
+        pthread_mutex_lock(&fs->plock);
+    }
+}
+
+static void *flusher(void *arg)
+{
+    struct FileSystem *fs = arg;
+    pthread_mutex_lock(&fs->plock);
+    while (!fs->fstop) {
+        // Look at the pages twice per age, enough to flush them about on time
+        u32 wait = fs->flush_age / 2 > 10 ? fs->flush_age / 2 : 10;
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += wait / 1000;
+        ts.tv_nsec += (long)(wait % 1000) * 1000000;
+        if (ts.tv_nsec >= 1000000000) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&fs->fcond, &fs->plock, &ts);
+        if (!fs->fstop && fs->nused)
+            writeback(fs);
+    }
+    pthread_mutex_unlock(&fs->plock);
+    return 0;
+}
+
+static void flusher_start(struct FileSystem *fs)
+{
+    fs->flush_age = FLUSH_AGE;
+    fs->flush_ratio = FLUSH_RATIO;
+    pthread_cond_init(&fs->fcond, 0);
+    assert(!pthread_create(&fs->flusher, 0, flusher, fs));
+    fs->flushing = 1;
+}
+
+static void flusher_stop(struct FileSystem *fs)
+{
+    if (!fs->flushing)
+        return;
+    pthread_mutex_lock(&fs->plock);
+    fs->fstop = 1;
+    pthread_cond_signal(&fs->fcond);
+    pthread_mutex_unlock(&fs->plock);
+    pthread_join(fs->flusher, 0);
+    pthread_cond_destroy(&fs->fcond);
+    fs->flushing = 0;
+}
+
+// Write to inode n, which the caller holds exclusively. Set *flushed
+// if anything was written to disk, so that the caller checks the fs.
+// Returns how much was written, short if the disk filled up, or -1.
+static u32 cache_write(struct FileSystem *fs, u32 n, void *buf, u32 sz, u64 off, int *flushed)
+{
+    struct dinode di;
+    if (off > MAXFILE_BYTES || sz > MAXFILE_BYTES - off)
+        return -1;
+    read_inode(fs, n, &di);
+    // Contiguous files have their blocks already: nothing to delay
+    if (di.type != T_REG || (di.flags & I_CONTIG) || !sz) {
+        *flushed = 1;
+        return inode_rw(fs, n, buf, sz, off, 1);
+    }
+    // Nor are direct writes cached, and they must not be overwritten by
+    // older pages flushed later
+    if (direct_ok(fs, &di, buf, sz, off)) {
+        *flushed = 1;
+        inode_flush(fs, n);
+        return inode_rw(fs, n, buf, sz, off, 1);
+    }
+    u32 sblock = off / BLOCKSIZE;
+    u32 eblock = (off + sz - 1) / BLOCKSIZE;
+    for (u32 lb = sblock; lb <= eblock; lb++) {
+        u64 bs = (u64)lb * BLOCKSIZE;
+        u64 s = off > bs ? off : bs;
+        u64 e = off + sz < bs + BLOCKSIZE ? off + sz : bs + BLOCKSIZE;
+        pthread_mutex_lock(&fs->plock);
+        struct page *p = page_lookup(fs, n, lb);
+        pthread_mutex_unlock(&fs->plock);
+        int fresh = !p;
+        int need = fresh && block_needed(fs, &di, lb);
+        int room = !need || !cache_reserve(fs, n, 1);
+        if (!room && fs->npages[n]) {
+            // Flushing our own pages gives back what was held for them
+            // beyond the blocks they take
+            *flushed = 1;
+            inode_flush(fs, n);
+            read_inode(fs, n, &di);
+            room = !cache_reserve(fs, n, 1);
+        }
+        if (fresh && room) {
+            pthread_mutex_lock(&fs->plock);
+            if (!(p = page_add(fs, n, lb)) && fs->npages[n]) {
+                // Full: make room by flushing our own pages. Those of other
+                // inodes are left alone, their owners may be using them.
+                // This gives back what was held for this page too.
+                pthread_mutex_unlock(&fs->plock);
+                *flushed = 1;
+                inode_flush(fs, n);
+                read_inode(fs, n, &di);
+                room = !need || !cache_reserve(fs, n, 1);
+                pthread_mutex_lock(&fs->plock);
+                p = room ? page_add(fs, n, lb) : 0;
+            }
+            // Past the dirty ratio, have the flusher catch up
+            if (p && fs->nused * 100 >= fs->flush_ratio * NPAGES)
+                pthread_cond_signal(&fs->fcond);
+            pthread_mutex_unlock(&fs->plock);
+            if (!p && room && need)
+                cache_reserve(fs, n, -1);
+        }
+        if (!p) {
+            // Still full, or no room held back: write this block through,
+            // which allocates it now or fails
+            *flushed = 1;
+            u32 got = inode_rw(fs, n, (char *)buf + (s - off), e - s, s, 1);
+            if (got != e - s) {
+                sz = s - off + (got == (u32)-1 ? 0 : got);
+                break;
+            }
+            continue;
+        }
+        if (fresh) {
+            memset(p->data, 0, BLOCKSIZE);
+            if (e - s < BLOCKSIZE && bs < di.size)
+                inode_rw(fs, n, p->data, BLOCKSIZE, bs, 0);
+        }
+        memcpy(p->data + (s - bs), (char *)buf + (s - off), e - s);
+    }
+    read_inode(fs, n, &di);
+    if (off + sz > di.size) {
+        di.size = off + sz;
+        assert(!write_inode(fs, n, &di));
+    }
+    return sz ? sz : (u32)-1;
+}
+
+/**
+ * @brief Write to an inode
+ * 
+ * Writes to regular files go to the page cache (see "Delayed allocation"
+ * above). A block only partially covered by the write is read in first.
+ */
+u32 inode_write(struct FileSystem *fs, u32 n, void *buf, u32 sz, u64 off) {
+    int flushed = 0;
+    if (n >= fs->su.ninodes || fs->map)
+        return -1;
+    fs_lock(fs, 0);
+    pthread_rwlock_wrlock(&fs->ilock[n]);
+    u32 ret = cache_write(fs, n, buf, sz, off, &flushed);
+    pthread_rwlock_unlock(&fs->ilock[n]);
+    fs_unlock(fs);
+    if (flushed)
+        fs_check(fs);
+    return ret;
+}
+
+/**
+ * @brief Read from an inode, including data still in the page cache
+ */
+u32 inode_read(struct FileSystem *fs, u32 n, void *buf, u32 sz, u64 off) {
+    if (n >= fs->su.ninodes)
+        return -1;
+    fs_lock(fs, 0);
+    if (!fs->map)
+        pthread_rwlock_rdlock(&fs->ilock[n]);
+    u32 got = inode_rw(fs, n, buf, sz, off, 0);
+    if (got != (u32)-1 && got && fs->npages[n]) {
+        pthread_mutex_lock(&fs->plock);
+        for (u32 lb = off / BLOCKSIZE; lb <= (off + got - 1) / BLOCKSIZE; lb++) {
+            struct page *p = page_lookup(fs, n, lb);
+            if (!p)
+                continue;
+            u64 bs = (u64)lb * BLOCKSIZE;
+            u64 s = off > bs ? off : bs;
+            u64 e = off + got < bs + BLOCKSIZE ? off + got : bs + BLOCKSIZE;
+            memcpy((char *)buf + (s - off), p->data + (s - bs), e - s);
+        }
+        pthread_mutex_unlock(&fs->plock);
+    }
+    if (!fs->map)
+        pthread_rwlock_unlock(&fs->ilock[n]);
+    fs_unlock(fs);
+    return got;
+}
+
+/**
+ * @brief Give a new inode an allocation goal near its parent directory
+ * 
+ * Until the file has blocks of its own to follow, its first blocks are
+ * allocated as close as possible to the end of the parent directory's data.
+ * The hint lives in memory only.
+ * 
+ * @param n The inode number of the new file.
+ * @param parent The inode number of the directory it was created in.
+ */
+void inode_hint(struct FileSystem *fs, u32 n, u32 parent)
+{
+    struct dinode di;
+    if (n >= fs->su.ninodes || parent >= fs->su.ninodes || fs->map)
+        return;
+    fs_lock(fs, 0);
+    pthread_rwlock_rdlock(&fs->ilock[parent]);
+    read_inode(fs, parent, &di);
+    u32 last = di.size ? bmap(fs, &di, (di.size - 1) / BLOCKSIZE) : 0;
+    fs->hint[n] = last ? last + 1 : 0;
+    pthread_rwlock_unlock(&fs->ilock[parent]);
+    fs_unlock(fs);
+}
+
+/**
+ * @brief Set the I_* flags of an empty regular file
+ * 
+ * Flags change how the data is laid out, so they can only be set before
+ * anything is written.
+ * 
+ * @param n The inode number.
+ * @param flags The new flags.
+ * @return int Returns 0 on success, -1 on failure.
+ */
+int inode_setflags(struct FileSystem *fs, u32 n, u16 flags)
+{
+    struct dinode di;
+    int ret = -1;
+    if (n >= fs->su.ninodes || fs->map)
+        return -1;
+    fs_lock(fs, 0);
+    pthread_rwlock_wrlock(&fs->ilock[n]);
+    read_inode(fs, n, &di);
+    // I_CONTIG comes with blocks: only inode_reserve() sets it
+    if (di.type == T_REG && !di.size && !fs->npages[n] && !((di.flags | flags) & I_CONTIG)) {
+        di.flags = flags;
+        write_inode(fs, n, &di);
+        ret = 0;
+    }
+    pthread_rwlock_unlock(&fs->ilock[n]);
+    fs_unlock(fs);
+    return ret;
+}
+
+// Count one reference to 'ptr' into the expected refcount array 'refs',
+// descending into an indirect block only on its first visit, since
+// everything below a shared block is referenced once, by the block itself.
+static void recursive_count(struct FileSystem *fs, u16 *refs, u32 ptr, int ilevel) 
+{
+    if (!ptr)
+        return;
+    assert(ptr >= fs->su.sdata && ptr < fs->su.sdata + fs->su.nblock_dat);
+    if (refs[ptr - fs->su.sdata]++ || !ilevel)
+        return;
+    union block b;
+    disk_read(fs, ptr, &b);
+    for (int i = 0; i < NPTRS_PER_BLOCK; i++)
+        recursive_count(fs, refs, b.ptrs[i], ilevel - 1);
+}
+
+// Count the references held by every allocated inode in an inode block
+static void count_inode_block(struct FileSystem *fs, u16 *refs, union block *b)
+{
+    for (int j = 0; j < NINODES_PER_BLOCK; j++)
+        if (b->inodes[j].type)
+            for (int k = 0; k < NPTRS; k++)
+                recursive_count(fs, refs, b->inodes[j].ptrs[k], get_ilevel(k));
+}
+
+// Check fs correctness. The caller holds fs->lock exclusively.
+static void fs_checker(struct FileSystem *fs) 
+{
+    union block b;
+    union block r;
+    // Count the references to each data block from the live
+    // inodes and the frozen inode tables of all snapshots
+    u16 *refs = calloc(fs->su.nblock_dat, sizeof(u16));
+    assert(refs);
+    for (int i = 0; i < fs->su.nblock_inode; i++) {
+        itable_read(fs, i, &b);
+        count_inode_block(fs, refs, &b);
+    }
+    for (int s = 0; s < NSNAPSHOTS; s++) {
+        if (!fs->su.snaps[s].name[0])
+            continue;
+        recursive_count(fs, refs, fs->su.snaps[s].root, 0);
+        disk_read(fs, fs->su.snaps[s].root, &r);
+        for (int i = 0; i < fs->su.nblock_inode; i++) {
+            recursive_count(fs, refs, r.ptrs[i], 0);
+            disk_read(fs, r.ptrs[i], &b);
+            count_inode_block(fs, refs, &b);
+        }
+    }
+    // Those must match the refcount blocks, and exactly
+    // the referenced blocks must be marked in the bitmap
+    disk_read(fs, fs->su.sbitmap, &b);
+    for (u32 i = 0; i < fs->su.nblock_dat; i++) {
+        if (i % NREFS_PER_BLOCK == 0)
+            disk_read(fs, fs->su.srefcnt + i/NREFS_PER_BLOCK, &r);
+        assert(refs[i] == r.refs[i%NREFS_PER_BLOCK]);
+        if (i < fs->su.nblock_dat / 8 * 8)
+            assert(!!refs[i] == ((b.bytes[i/8] >> (i%8)) & 1));
+    }
+    free(refs);
+    // The usage counters must agree with the bitmap and the inode table
+    struct superblock su;
+    usage_scan(fs, &su);
+    assert(su.nfree == fs->su.nfree && su.nifree == fs->su.nifree);
+    assert(!memcmp(su.ntype, fs->su.ntype, sizeof su.ntype));
+}
+
+/**
+ * @brief print superblock information
+ * 
+ */
+static void printsu(struct FileSystem *fs) {
+    mylog(fs, "superblock:\n"
+            "#inodes:%u\n"
+            "#blocks(tot):%u\n"
+            "#blocks(res):%u\n"
+            "#blocks(log):%u\n"
+            "#blocks(ino):%u\n"
+            "#blocks(ref):%u\n"
+            "#blocks(sum):%u\n"
+            "#blocks(gen):%u\n"
+            "#blocks(dat):%u\n"
+            "start(log):%u\n"
+            "start(ino):%u\n"
+            "start(bmp):%u\n"
+            "start(ref):%u\n"
+            "start(sum):%u\n"
+            "start(gen):%u\n"
+            "start(dat):%u\n"
+            "magic:%x\n"
+            "features:%x\n"
+            "rev:%u\n"
+            "itable_init:%u\n"
+            "free(dat):%u\n"
+            "free(ino):%u\n"
+            "gen:%u\n",
+            fs->su.ninodes, 
+            fs->su.nblock_tot, 
+            fs->su.nblock_res,
+            fs->su.nblock_log,
+            fs->su.nblock_inode, 
+            fs->su.nblock_refcnt,
+            fs->su.nblock_csum,
+            fs->su.nblock_gen,
+            fs->su.nblock_dat,
+            fs->su.slog,
+            fs->su.sinode,
+            fs->su.sbitmap,
+            fs->su.srefcnt,
+            fs->su.scsum,
+            fs->su.sgen,
+            fs->su.sdata,
+            fs->su.magic,
+            fs->su.features,
+            fs->su.rev,
+            fs->su.itable_init,
+            fs->su.nfree,
+            fs->su.nifree,
+            fs->su.gen
+    );
+}
+
+// Write the in-memory superblock back to disk
+static void write_su(struct FileSystem *fs)
+{
+    union block b;
+    memset(&b, 0, sizeof b);
+    // The block counter changes under fs->alock
+    pthread_mutex_lock(&fs->alock);
+    b.su = fs->su;
+    pthread_mutex_unlock(&fs->alock);
+    disk_write(fs, SUBLOCK_NUM, &b);
+}
+
+static int find_snapshot(struct FileSystem *fs, const char *name)
+{
+    for (int i = 0; i < NSNAPSHOTS; i++)
+        if (fs->su.snaps[i].name[0] && !strncmp(fs->su.snaps[i].name, name, MAXNAME))
+            return i;
+    return -1;
+}
+
+// Add one reference to every root pointer of an inode.
+// Fails with nothing changed if any count would overflow.
+static int share_inode(struct FileSystem *fs, struct dinode *di)
+{
+    for (int k = 0; k < NPTRS; k++) {
+        if (!di->ptrs[k] || !ref_inc(fs, di->ptrs[k]))
+            continue;
+        // Undo the references added so far
+        while (k--)
+            if (di->ptrs[k])
+                ref_dec(fs, di->ptrs[k]);
+        return -1;
+    }
+    return 0;
+}
+
+// Drop one reference from every root pointer of an inode
+static void unshare_inode(struct FileSystem *fs, struct dinode *di)
+{
+    for (int k = 0; k < NPTRS; k++)
+        if (di->ptrs[k])
+            free_indirect(fs, di->ptrs[k], get_ilevel(k));
+}
+
+// Add (inc=1) or drop (inc=0) one reference to every root pointer held by the
+// allocated inodes in an inode block. Adding fails with nothing changed if
+// any count would overflow.
+static int share_inode_block(struct FileSystem *fs, union block *b, int inc)
+{
+    for (int j = 0; j < NINODES_PER_BLOCK; j++) {
+        if (!b->inodes[j].type)
+            continue;
+        if (!inc) {
+            unshare_inode(fs, &b->inodes[j]);
+            continue;
+        }
+        if (!share_inode(fs, &b->inodes[j]))
+            continue;
+        while (j--)
+            if (b->inodes[j].type)
+                unshare_inode(fs, &b->inodes[j]);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Make inode 'dst' a clone of inode 'src' sharing all its blocks
+ * 
+ * The clone takes one reference on each of the source's root pointers, so
+ * it is instant regardless of the file size. Either side copies the blocks
+ * it modifies on first write. Any blocks 'dst' held before are released.
+ * 
+ * @param dst The inode number of the clone.
+ * @param src The inode number of the file to be cloned.
+ * @return int Returns 0 on success, -1 on failure.
+ */
+static int clone_inode(struct FileSystem *fs, u32 dst, u32 src)
+{
+    struct dinode sdi;
+    struct dinode ddi;
+    if (dst >= fs->su.ninodes || src >= fs->su.ninodes || dst == src)
+        return -1;
+    read_inode(fs, src, &sdi);
+    read_inode(fs, dst, &ddi);
+    if (!sdi.type || !ddi.type)
+        return -1;
+    inode_flush(fs, src);
+    cache_drop(fs, dst);
+    read_inode(fs, src, &sdi);
+    if (share_inode(fs, &sdi))
+        return -1;
+    unshare_inode(fs, &ddi);
+    memcpy(ddi.ptrs, sdi.ptrs, sizeof ddi.ptrs);
+    ddi.size = sdi.size;
+    ddi.flags = sdi.flags;
+    write_inode(fs, dst, &ddi);
+    fs_checker(fs);
+    return 0;
+}
+
+// Release a (possibly partially built) snapshot inode table
+static void release_snapshot(struct FileSystem *fs, u32 root)
+{
+    union block r;
+    union block b;
+    disk_read(fs, root, &r);
+    for (int i = 0; i < fs->su.nblock_inode; i++) {
+        if (!r.ptrs[i])
+            continue;
+        disk_read(fs, r.ptrs[i], &b);
+        share_inode_block(fs, &b, 0);
+        ref_dec(fs, r.ptrs[i]);
+    }
+    ref_dec(fs, root);
+}
+
+/**
+ * @brief Freeze the current tree as a named read-only snapshot
+ * 
+ * Only the inode table is copied. Every block reachable from it gains one
+ * reference at its root pointer, so the cost does not depend on how much
+ * data the tree holds. Later writes to the live tree copy shared blocks on
+ * first modification.
+ * 
+ * @param name The name of the snapshot.
+ * @return int Returns 0 on success, -1 on failure.
+ */
+static int snapshot_create(struct FileSystem *fs, const char *name)
+{
+    int s;
+    union block r;
+    union block b;
+    if (!name || !name[0] || strlen(name) >= MAXNAME || find_snapshot(fs, name) >= 0)
+        return -1;
+    for (s = 0; s < NSNAPSHOTS && fs->su.snaps[s].name[0]; s++);
+    if (s == NSNAPSHOTS)
+        return -1;
+    sync_all(fs);
+    u32 root = bitmap_alloc(fs, 0);
+    if (!root)
+        return -1;
+    memset(&r, 0, sizeof r);
+    disk_write(fs, root, &r);
+    for (int i = 0; i < fs->su.nblock_inode; i++) {
+        itable_read(fs, i, &b);
+        if (!(r.ptrs[i] = bitmap_alloc(fs, root + 1 + i)) || share_inode_block(fs, &b, 1)) {
+            if (r.ptrs[i])
+                ref_dec(fs, r.ptrs[i]);
+            r.ptrs[i] = 0;
+            disk_write(fs, root, &r);
+            release_snapshot(fs, root);
+            return -1;
+        }
+        disk_write(fs, r.ptrs[i], &b);
+    }
+    disk_write(fs, root, &r);
+    strncpy(fs->su.snaps[s].name, name, MAXNAME);
+    fs->su.snaps[s].root = root;
+    write_su(fs);
+    fs_checker(fs);
+    return 0;
+}
+
+/**
+ * @brief Delete a snapshot, freeing the blocks only it still references
+ * 
+ * @param name The name of the snapshot.
+ * @return int Returns 0 on success, -1 if there is no such snapshot.
+ */
+static int snapshot_delete(struct FileSystem *fs, const char *name)
+{
+    int s = find_snapshot(fs, name);
+    if (s < 0)
+        return -1;
+    release_snapshot(fs, fs->su.snaps[s].root);
+    memset(&fs->su.snaps[s], 0, sizeof fs->su.snaps[s]);
+    write_su(fs);
+    fs_checker(fs);
+    return 0;
+}
+
+/**
+ * @brief Replace the live tree with the content of a snapshot
+ * 
+ * The current tree is dropped and the snapshot's inode table becomes the live
+ * one, sharing its blocks with the snapshot, which is kept. No file may be
+ * open while rolling back.
+ * 
+ * @param name The name of the snapshot.
+ * @return int Returns 0 on success, -1 on failure.
+ */
+static int snapshot_rollback(struct FileSystem *fs, const char *name)
+{
+    int s = find_snapshot(fs, name);
+    union block r;
+    union block b;
+    if (s < 0)
+        return -1;
+    sync_all(fs);
+    disk_read(fs, fs->su.snaps[s].root, &r);
+    for (int i = 0; i < fs->su.nblock_inode; i++) {
+        disk_read(fs, r.ptrs[i], &b);
+        if (share_inode_block(fs, &b, 1)) {
+            // Undo the blocks shared so far and leave the live tree as is
+            while (i--) {
+                disk_read(fs, r.ptrs[i], &b);
+                share_inode_block(fs, &b, 0);
+            }
+            return -1;
+        }
+    }
+    for (int i = 0; i < fs->su.nblock_inode; i++) {
+        itable_read(fs, i, &b);
+        share_inode_block(fs, &b, 0);
+        itable_account(&fs->su, &b, -1);
+        disk_read(fs, r.ptrs[i], &b);
+        itable_account(&fs->su, &b, 1);
+        itable_write(fs, i, &b);
+    }
+    fs_checker(fs);
+    return 0;
+}
+
+/**
+ * @brief List snapshot names
+ * 
+ * @param names Buffer receiving up to 'n' names.
+ * @param n Capacity of 'names'.
+ * @return int The number of names stored.
+ */
+static int snapshot_list(struct FileSystem *fs, char names[][MAXNAME], int n)
+{
+    int cnt = 0;
+    for (int i = 0; i < NSNAPSHOTS && cnt < n; i++)
+        if (fs->su.snaps[i].name[0])
+            strncpy(names[cnt++], fs->su.snaps[i].name, MAXNAME);
+    return cnt;
+}
+
+/**
+ * @brief Turn block deduplication on or off
+ * 
+ * Meant for bulk imports: while on, full blocks written to regular files are
+ * deduplicated against the blocks written since it was turned on, and zero
+ * blocks are left as holes. The fingerprint index lives in memory only.
+ * 
+ * @param on Non-zero to turn deduplication on.
+ * @return u32 When turning it off, the number of blocks deduplicated.
+ */
+static u32 dedup_set(struct FileSystem *fs, int on)
+{
+    // Pending writes are deduplicated or not under the current setting
+    sync_all(fs);
+    u32 n = fs->ndedup;
+    free(fs->fphead);
+    free(fs->fpnext);
+    free(fs->fpval);
+    fs->fphead = fs->fpnext = fs->fpval = 0;
+    fs->ndedup = 0;
+    if (!on)
+        return n;
+    fs->nfpbucket = fs->su.nblock_dat;
+    assert((fs->fphead = calloc(fs->nfpbucket, sizeof(u32))));
+    assert((fs->fpnext = calloc(fs->su.nblock_dat, sizeof(u32))));
+    assert((fs->fpval = calloc(fs->su.nblock_dat, sizeof(u32))));
+    return 0;
+}
+
+// Defragmentation
+//
+// A file's blocks are listed in layout order: each indirect block comes right
+// before the blocks it maps, which is the order a sequential read visits them.
+// A fragment is a maximal run of consecutive block numbers in that list.
+// Relocating a file copies its whole tree, in that order, into a run of free
+// blocks. The inode is switched to the new tree before the old one is freed,
+// so an interruption leaks blocks at worst. Files with shared blocks
+// (snapshots, clones, deduplicated data) are left alone, since moving a
+// shared block means rewriting every referrer.
+
+// Append the blocks of a tree in layout order. Stop and return -1 at the
+// first shared block: the list holds each block at most once, so that it
+// fits in nblock_dat entries, and a block mapped twice (a file deduplicated
+// against itself) is shared.
+static int tree_blocks(struct FileSystem *fs, u32 ptr, int ilevel, u32 *list, u32 *n)
+{
+    union block b;
+    if (!ptr)
+        return 0;
+    if (ref_get(fs, ptr) > 1)
+        return -1;
+    list[(*n)++] = ptr;
+    if (!ilevel)
+        return 0;
+    disk_read(fs, ptr, &b);
+    for (int i = 0; i < NPTRS_PER_BLOCK; i++)
+        if (tree_blocks(fs, b.ptrs[i], ilevel - 1, list, n))
+            return -1;
+    return 0;
+}
+
+// List the blocks of a file, or return -1 if it has shared ones
+static int inode_blocks(struct FileSystem *fs, struct dinode *di, u32 *list, u32 *n)
+{
+    *n = 0;
+    for (int i = 0; i < NPTRS; i++)
+        if (tree_blocks(fs, di->ptrs[i], get_ilevel(i), list, n))
+            return -1;
+    return 0;
+}
+
+static u32 count_frags(u32 *list, u32 n)
+{
+    u32 frags = n ? 1 : 0;
+    for (u32 i = 1; i < n; i++)
+        if (list[i] != list[i-1] + 1)
+            frags++;
+    return frags;
 }
 
-u32 inode_read(u32 n, void *buf, u32 sz, u32 off) {
-    return inode_rw(n, buf, sz, off, 0);
+// Copy a tree into consecutive blocks starting at *next, in layout order
+static void relocate_tree(struct FileSystem *fs, u32 *pp, int ilevel, u32 *next)
+{
+    union block b;
+    if (!*pp)
+        return;
+    u32 nb = (*next)++;
+    disk_read(fs, *pp, &b);
+    if (ilevel)
+        for (int i = 0; i < NPTRS_PER_BLOCK; i++)
+            relocate_tree(fs, &b.ptrs[i], ilevel - 1, next);
+    // The copy is checksummed if the original was
+    block_write(fs, nb, &b, ilevel || fs->csum[*pp]);
+    *pp = nb;
 }
 
-static u32 recursive_count(u32 ptr, int ilevel) 
+/**
+ * @brief Defragment the data blocks of every file
+ * 
+ * Each fragmented file is moved into the first free run large enough for its
+ * whole tree. With 'pack' set, directories and small files are first packed
+ * together, one after the other, from the start of the data section.
+ * 
+ * @param pack Pack directories and files of at most NDIRECT blocks together.
+ * @param report If not NULL, called for each file looked at, with its block
+ *               count and fragment counts before and after. Files with
+ *               shared blocks are not looked at.
+ * @return int The number of files relocated.
+ */
+static int defrag(struct FileSystem *fs, int pack, void (*report)(u32 inum, u32 nblocks, u32 before, u32 after))
+{
+    struct dinode di;
+    struct dinode old;
+    u32 *list = malloc(fs->su.nblock_dat * sizeof(u32));
+    u32 cursor = fs->su.sdata;
+    int moved = 0;
+    assert(list);
+    sync_all(fs);
+    // Pass 0 packs directories and small files, pass 1 handles the rest
+    for (int pass = !pack; pass < 2; pass++) {
+        for (u32 inum = ROOTINUM; inum < fs->su.ninodes; inum++) {
+            u32 n;
+            read_inode(fs, inum, &di);
+            if (!di.type)
+                continue;
+            // Contiguous files stay where they were put
+            if (di.type == T_REG && (di.flags & I_CONTIG))
+                continue;
+            if (inode_blocks(fs, &di, list, &n))
+                continue;
+            int small = di.type == T_DIR || n <= NDIRECT;
+            if (!n || (pack && pass == 0 && !small) || (pack && pass == 1 && small))
+                continue;
+            u32 before = count_frags(list, n);
+            u32 start = 0;
+            // Packed files go right after one another; others only
+            // move if fragmented.
+            if (pass == 0 && list[0] == cursor && before == 1)
+                start = list[0];
+            else if ((pass == 0 || before > 1) &&
+                     (start = bitmap_find_run(fs, n, pass == 0 ? cursor : fs->su.sdata))) {
+                old = di;
+                bitmap_alloc_run(fs, start, n);
+                u32 next = start;
+                for (int i = 0; i < NPTRS; i++)
+                    relocate_tree(fs, &di.ptrs[i], get_ilevel(i), &next);
+                write_inode(fs, inum, &di);
+                unshare_inode(fs, &old);
+                inode_blocks(fs, &di, list, &n);
+                moved++;
+            }
+            if (pass == 0 && start)
+                cursor = start + n;
+            if (report)
+                report(inum, n, before, count_frags(list, n));
+        }
+    }
+    free(list);
+    fs_checker(fs);
+    return moved;
+}
+
+// The number of blocks in a tree at 'ilevel' mapping 'ndata' data blocks
+static u32 tree_size(u32 ndata, int ilevel)
 {
-    if (!ptr)
-        return 0;
     if (!ilevel)
         return 1;
-    union block b;
-    u32 cnt = 1; // include this indirect block
-    disk_read(ptr, &b);
-    for (int i = 0; i < NPTRS_PER_BLOCK; i++)
-        cnt += recursive_count(b.ptrs[i], ilevel - 1);
+    u32 span = ilevel_span(ilevel - 1);
+    u32 cnt = 1;
+    for (u32 left = ndata; left; left -= left < span ? left : span)
+        cnt += tree_size(left < span ? left : span, ilevel - 1);
     return cnt;
 }
 
-// Check fs correctness
-static void fs_checker() 
+// Build a tree at 'ilevel' mapping 'ndata' zeroed data blocks under *pp,
+// out of consecutive blocks from *next on, in layout order
+static void contig_fill(struct FileSystem *fs, u32 *pp, int ilevel, u32 ndata, u32 *next)
 {
     union block b;
-    // Count the number of data blocks referenced by inodes
-    u32 datacnt1 = 0;
-    u32 datacnt2 = 0;
-    for (int i = 0; i < fs.su.nblock_inode; i++) {
-        disk_read(fs.su.sinode + i, &b);
-        for (int j = 0; j < NINODES_PER_BLOCK; j++)
-            if (b.inodes[j].type)
-                for (int k = 0; k < NPTRS; k++)
-                    datacnt1 += recursive_count(b.inodes[j].ptrs[k], get_ilevel(k));
+    memset(&b, 0, sizeof b);
+    *pp = (*next)++;
+    if (ilevel) {
+        u32 span = ilevel_span(ilevel - 1);
+        for (u32 i = 0; ndata; i++) {
+            u32 cnt = ndata < span ? ndata : span;
+            contig_fill(fs, &b.ptrs[i], ilevel - 1, cnt, next);
+            ndata -= cnt;
+        }
     }
-    // Count the number of data blocks marked as used in the bitmap
-    disk_read(fs.su.sbitmap, &b);
-    for (int i = 0; i < fs.su.nblock_dat / 8; i++)
-        for (int off = 0; off < 8; off++)
-            if (((b.bytes[i] >> off) & 1) && (off + i * 8) < fs.su.nblock_dat)
-                datacnt2 += 1;
-    assert(datacnt1 == datacnt2);
+    // The run may hold anything: data blocks are zeroed too
+    block_write(fs, *pp, &b, ilevel || (fs->su.features & FEAT_CSUM_DATA));
 }
 
 /**
- * @brief print superblock information
+ * @brief Lay out an empty regular file in a single run of blocks
+ * 
+ * Blocks for 'size' bytes are allocated at once, as one run in layout order:
+ * each indirect block comes right before the blocks it maps. The file is
+ * flagged I_CONTIG, so writes go to those blocks in place and never allocate
+ * others; they fail past the end of the run. Only copy-on-write, after a
+ * snapshot or a clone, can move a block (see inode_extent()).
  * 
+ * @return int 0 on success, -1 if the file is not an empty regular file
+ *         without flags or there is no free run long enough.
  */
-static void printsu() {
-    mylog("superblock:\n"
-            "#inodes:%u\n"
-            "#blocks(tot):%u\n"
-            "#blocks(res):%u\n"
-            "#blocks(log):%u\n"
-            "#blocks(ino):%u\n"
-            "#blocks(dat):%u\n"
-            "start(log):%u\n"
-            "start(ino):%u\n"
-            "start(bmp):%u\n"
-            "start(dat):%u\n"
-            "magic:%x\n",
-            fs.su.ninodes, 
-            fs.su.nblock_tot, 
-            fs.su.nblock_res,
-            fs.su.nblock_log,
-            fs.su.nblock_inode, 
-            fs.su.nblock_dat,
-            fs.su.slog,
-            fs.su.sinode,
-            fs.su.sbitmap,
-            fs.su.sdata,
-            fs.su.magic
-    );
+int inode_reserve(struct FileSystem *fs, u32 n, u64 size)
+{
+    struct dinode di;
+    u64 ndata = (size + BLOCKSIZE - 1) / BLOCKSIZE;
+    int ret = -1;
+    if (n >= fs->su.ninodes || !ndata || ndata > fs->su.nblock_dat || fs->map)
+        return -1;
+    fs_lock(fs, 0);
+    pthread_rwlock_wrlock(&fs->ilock[n]);
+    read_inode(fs, n, &di);
+    if (di.type == T_REG && !di.size && !fs->npages[n] && !di.flags) {
+        u32 total = 0;
+        u32 left = ndata;
+        for (int i = 0; i < NPTRS && left; i++) {
+            u32 cnt = left < ilevel_span(get_ilevel(i)) ? left : ilevel_span(get_ilevel(i));
+            total += tree_size(cnt, get_ilevel(i));
+            left -= cnt;
+        }
+        pthread_mutex_lock(&fs->alock);
+        u32 start = bitmap_find_run(fs, total, fs->hint[n]);
+        if (start)
+            bitmap_alloc_run(fs, start, total);
+        pthread_mutex_unlock(&fs->alock);
+        if (start) {
+            u32 next = start;
+            left = ndata;
+            for (int i = 0; i < NPTRS && left; i++) {
+                u32 cnt = left < ilevel_span(get_ilevel(i)) ? left : ilevel_span(get_ilevel(i));
+                contig_fill(fs, &di.ptrs[i], get_ilevel(i), cnt, &next);
+                left -= cnt;
+            }
+            assert(next == start + total);
+            di.flags = I_CONTIG;
+            write_inode(fs, n, &di);
+            ret = 0;
+        }
+    }
+    pthread_rwlock_unlock(&fs->ilock[n]);
+    fs_unlock(fs);
+    return ret;
 }
 
-void fs_init(const char *vhd) {
-    if (!(fs.log = fopen("log", "w"))) {
-        perror("fopen");
-        exit(1);
+/**
+ * @brief Locate the run of blocks of a file laid out by inode_reserve()
+ * 
+ * @param start Receives the first block of the run.
+ * @param len Receives the number of blocks in the run, indirect ones included.
+ * @return int 0 on success, -1 if the file is not I_CONTIG or its blocks
+ *         no longer form one run, or some are shared.
+ */
+int inode_extent(struct FileSystem *fs, u32 n, u32 *start, u32 *len)
+{
+    struct dinode di;
+    u32 cnt;
+    int ret = -1;
+    if (n >= fs->su.ninodes)
+        return -1;
+    u32 *list = malloc(fs->su.nblock_dat * sizeof(u32));
+    assert(list);
+    fs_lock(fs, 0);
+    pthread_rwlock_rdlock(&fs->ilock[n]);
+    read_inode(fs, n, &di);
+    if (di.type == T_REG && (di.flags & I_CONTIG)) {
+        if (!inode_blocks(fs, &di, list, &cnt) && count_frags(list, cnt) == 1) {
+            *start = list[0];
+            *len = cnt;
+            ret = 0;
+        }
+    }
+    pthread_rwlock_unlock(&fs->ilock[n]);
+    fs_unlock(fs);
+    free(list);
+    return ret;
+}
+
+/**
+ * @brief Verify every checksummed block on the disk
+ * 
+ * @param nchecked If not NULL, receives the number of blocks verified.
+ * @return int The number of blocks whose content doesn't match its checksum.
+ */
+static int scrub(struct FileSystem *fs, u32 *nchecked)
+{
+    union block b;
+    u32 checked = 0;
+    int bad = 0;
+    for (int i = SUBLOCK_NUM; i < fs->su.nblock_tot; i++) {
+        if (!fs->csum[i])
+            continue;
+        block_read(fs, i, &b);
+        if (csum_verify(fs, i, &b)) {
+            mylog(fs, "scrub: checksum mismatch on block %d\n", i);
+            bad++;
+        }
+        checked++;
+    }
+    if (nchecked)
+        *nchecked = checked;
+    return bad;
+}
+
+// Entry points that walk the whole tree run with fs->lock held exclusively
+
+int inode_clone(struct FileSystem *fs, u32 dst, u32 src)
+{
+    if (fs->map)
+        return -1;
+    fs_lock(fs, 1);
+    int ret = clone_inode(fs, dst, src);
+    fs_unlock(fs);
+    return ret;
+}
+
+int fs_snapshot_create(struct FileSystem *fs, const char *name)
+{
+    if (fs->map)
+        return -1;
+    fs_lock(fs, 1);
+    int ret = snapshot_create(fs, name);
+    fs_unlock(fs);
+    return ret;
+}
+
+int fs_snapshot_delete(struct FileSystem *fs, const char *name)
+{
+    if (fs->map)
+        return -1;
+    fs_lock(fs, 1);
+    int ret = snapshot_delete(fs, name);
+    fs_unlock(fs);
+    return ret;
+}
+
+int fs_snapshot_rollback(struct FileSystem *fs, const char *name)
+{
+    if (fs->map)
+        return -1;
+    fs_lock(fs, 1);
+    int ret = snapshot_rollback(fs, name);
+    bmcache_clear(fs);
+    fs_unlock(fs);
+    return ret;
+}
+
+int fs_snapshot_list(struct FileSystem *fs, char names[][MAXNAME], int n)
+{
+    fs_lock(fs, 1);
+    int ret = snapshot_list(fs, names, n);
+    fs_unlock(fs);
+    return ret;
+}
+
+u32 fs_dedup(struct FileSystem *fs, int on)
+{
+    if (fs->map)
+        return 0;
+    fs_lock(fs, 1);
+    u32 ret = dedup_set(fs, on);
+    fs_unlock(fs);
+    return ret;
+}
+
+int fs_defrag(struct FileSystem *fs, int pack, void (*report)(u32 inum, u32 nblocks, u32 before, u32 after))
+{
+    if (fs->map)
+        return -1;
+    fs_lock(fs, 1);
+    int ret = defrag(fs, pack, report);
+    fs_unlock(fs);
+    return ret;
+}
+
+int fs_scrub(struct FileSystem *fs, u32 *nchecked)
+{
+    fs_lock(fs, 1);
+    int ret = scrub(fs, nchecked);
+    fs_unlock(fs);
+    return ret;
+}
+
+/**
+ * @brief Flush the cached pages of every inode to disk
+ * 
+ * This also ends the current generation (see FEAT_CBT). On return,
+ * everything written before the call is durable.
+ * 
+ * @return int 0 on success, -1 if some pages could not be written, now or
+ *         by an earlier flush no fs_fsync() reported.
+ */
+int fs_sync(struct FileSystem *fs)
+{
+    int ret = 0;
+    if (fs->map)
+        return 0;
+    fs_lock(fs, 1);
+    if (sync_all(fs))
+        fs_checker(fs);
+    for (u32 n = 0; n < fs->su.ninodes; n++) {
+        ret |= -fs->wberr[n];
+        fs->wberr[n] = 0;
+    }
+    // Not if the image was left alone (see fs_init())
+    if (fs->gen && !fs->su.clean) {
+        fs->su.gen++;
+        write_su(fs);
+        cbt_flush(fs);
+    }
+    if (fsync(fs->vd))
+        ret = -1;
+    fs_unlock(fs);
+    return ret;
+}
+
+/**
+ * @brief Flush the cached pages of inode n to disk and wait until they are durable
+ * 
+ * The blocks and metadata the inode needs to be read back are durable on
+ * return. The usage counters of the superblock are not (see fs_init()).
+ * 
+ * @return int 0 on success, -1 on failure, including a flush of the inode
+ *         that failed earlier in the background (see inode_flush()).
+ */
+int fs_fsync(struct FileSystem *fs, u32 n)
+{
+    if (n >= fs->su.ninodes || fs->map)
+        return -1;
+    fs_lock(fs, 0);
+    pthread_rwlock_wrlock(&fs->ilock[n]);
+    int flushed = !!fs->npages[n];
+    inode_flush(fs, n);
+    int ret = -fs->wberr[n];
+    fs->wberr[n] = 0;
+    pthread_rwlock_unlock(&fs->ilock[n]);
+    fs_unlock(fs);
+    if (flushed)
+        fs_check(fs);
+    if (fdatasync(fs->vd))
+        ret = -1;
+    return ret;
+}
+
+/**
+ * @brief Report the number of blocks read from and written to the image since mounted
+ */
+void fs_iostat(struct FileSystem *fs, u64 *nread, u64 *nwritten)
+{
+    *nread = __atomic_load_n(&fs->nbread, __ATOMIC_RELAXED);
+    *nwritten = __atomic_load_n(&fs->nbwritten, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Tune the background writeback (see "Writeback")
+ * 
+ * @param age Pages are written back once older than this many milliseconds.
+ * @param ratio The oldest files are written back once this percentage of the
+ *        page cache is in use.
+ */
+void fs_writeback(struct FileSystem *fs, u32 age, u32 ratio)
+{
+    if (!fs->flushing)
+        return;
+    pthread_mutex_lock(&fs->plock);
+    fs->flush_age = age;
+    fs->flush_ratio = ratio;
+    pthread_cond_signal(&fs->fcond);
+    pthread_mutex_unlock(&fs->plock);
+}
+
+/**
+ * @brief Check the consistency of the block maps, refcounts and bitmap
+ * 
+ * Aborts on the first inconsistency.
+ */
+void fs_check(struct FileSystem *fs)
+{
+    fs_lock(fs, 1);
+    fs_checker(fs);
+    fs_unlock(fs);
+}
+
+/**
+ * @brief Report the free and used blocks and inodes, from the superblock counters
+ */
+void fs_statfs(struct FileSystem *fs, struct fsstat *st)
+{
+    fs_lock(fs, 0);
+    pthread_mutex_lock(&fs->itlock);
+    pthread_mutex_lock(&fs->alock);
+    st->nblocks = fs->su.nblock_dat / 8 * 8;
+    st->nfree = fs->su.nfree;
+    st->ninodes = fs->su.ninodes;
+    st->nifree = fs->su.nifree;
+    memcpy(st->ntype, fs->su.ntype, sizeof st->ntype);
+    pthread_mutex_unlock(&fs->alock);
+    pthread_mutex_unlock(&fs->itlock);
+    fs_unlock(fs);
+}
+
+/**
+ * @brief The current generation
+ * 
+ * A copy of the image taken now, while it is not mounted, can later be
+ * brought up to date with a delta exported since this generation.
+ */
+u32 fs_generation(struct FileSystem *fs)
+{
+    fs_lock(fs, 0);
+    u32 gen = fs->su.gen;
+    fs_unlock(fs);
+    return gen;
+}
+
+static int full_write(int fd, void *buf, size_t n)
+{
+    for (ssize_t w; n; buf = (char *)buf + w, n -= w)
+        if ((w = write(fd, buf, n)) <= 0)
+            return -1;
+    return 0;
+}
+
+static int full_read(int fd, void *buf, size_t n)
+{
+    for (ssize_t r; n; buf = (char *)buf + r, n -= r)
+        if ((r = read(fd, buf, n)) <= 0)
+            return -1;
+    return 0;
+}
+
+// Is block n part of a delta since generation 'since'? The generation blocks
+// always are: they are not tracked, and the receiving image needs them.
+static int delta_changed(struct FileSystem *fs, u32 n, u32 since)
+{
+    return !cbt_covers(fs, n) || fs->gen[n] >= since;
+}
+
+#define DELTA_CHUNK 64 // Blocks copied at a time
+
+/**
+ * @brief Write the blocks written since generation 'since' to 'fd', as a delta
+ * 
+ * The image is synced first, and exported as fs_exit() would leave it, so
+ * that the receiving image ends up unmounted cleanly.
+ * 
+ * @param since The generation of the image to update (see fs_generation()),
+ *              or 0 for every block.
+ * @param fd    Where the delta (see struct delta_hdr) is written.
+ * @return int The number of blocks exported, or -1 on error.
+ */
+int fs_delta_export(struct FileSystem *fs, u32 since, int fd)
+{
+    struct delta_hdr h = { .magic = DELTAMAGIC, .from = since, .nblock_tot = fs->su.nblock_tot };
+    char *buf;
+    int ret = -1;
+    fs_lock(fs, 1);
+    if (!fs->gen || since > fs->su.gen || !(buf = malloc(DELTA_CHUNK * BLOCKSIZE))) {
+        fs_unlock(fs);
+        return -1;
+    }
+    if (sync_all(fs))
+        fs_checker(fs);
+    fs->su.clean = 1;
+    write_su(fs);
+    cbt_flush(fs);
+    h.to = fs->su.gen;
+    // Count the runs for the header, then write them
+    for (int pass = 0; pass < 2; pass++) {
+        for (u32 n = 0; n < h.nblock_tot; ) {
+            struct delta_run r = { n, 0 };
+            for (; n < h.nblock_tot && delta_changed(fs, n, since); n++)
+                r.len++;
+            if (!r.len) {
+                n++;
+                continue;
+            }
+            if (!pass) {
+                h.nruns++;
+                h.nblocks += r.len;
+                continue;
+            }
+            if (full_write(fd, &r, sizeof r))
+                goto out;
+            for (u32 i = 0; i < r.len; i += DELTA_CHUNK) {
+                u32 cnt = r.len - i < DELTA_CHUNK ? r.len - i : DELTA_CHUNK;
+                if (pread(fs->vd, buf, cnt * BLOCKSIZE, (off_t)(r.start + i) * BLOCKSIZE) != cnt * BLOCKSIZE ||
+                    full_write(fd, buf, cnt * BLOCKSIZE))
+                    goto out;
+            }
+        }
+        if (!pass && full_write(fd, &h, sizeof h))
+            goto out;
+    }
+    ret = h.nblocks;
+out:
+    fs->su.clean = 0;
+    write_su(fs);
+    fs_unlock(fs);
+    free(buf);
+    return ret;
+}
+
+/**
+ * @brief Update the image at 'vhd' with a delta from fs_delta_export()
+ * 
+ * The image must not be mounted, must have been unmounted cleanly and must
+ * be at a generation the delta covers: a copy of the exporting image taken
+ * at generation 'from' or later, or an image a previous delta was applied
+ * to. The whole delta is checked before anything is written, which needs
+ * 'fd' to be seekable.
+ * 
+ * @return int The number of blocks written, or -1 if the delta does not apply.
+ */
+int fs_delta_apply(const char *vhd, int fd)
+{
+    struct delta_hdr h;
+    struct delta_run r;
+    union block b;
+    char *buf = 0;
+    int ret = -1;
+    int vd = open(vhd, O_RDWR);
+    if (vd == -1)
+        return -1;
+    if (pread(vd, &b, BLOCKSIZE, (off_t)SUBLOCK_NUM * BLOCKSIZE) != BLOCKSIZE ||
+        full_read(fd, &h, sizeof h) || h.magic != DELTAMAGIC ||
+        b.su.magic != FSMAGIC || !(b.su.features & FEAT_CBT) || !b.su.clean ||
+        h.nblock_tot != b.su.nblock_tot || b.su.gen < h.from || b.su.gen > h.to)
+        goto out;
+    off_t start = lseek(fd, 0, SEEK_CUR);
+    u32 nblocks = 0;
+    for (u32 i = 0; i < h.nruns; i++) {
+        if (full_read(fd, &r, sizeof r) || r.start > h.nblock_tot || r.len > h.nblock_tot - r.start ||
+            lseek(fd, (off_t)r.len * BLOCKSIZE, SEEK_CUR) == -1)
+            goto out;
+        nblocks += r.len;
+    }
+    // Seeking past the end succeeds: check that the delta is all there
+    if (nblocks != h.nblocks || lseek(fd, 0, SEEK_CUR) != lseek(fd, 0, SEEK_END) ||
+        lseek(fd, start, SEEK_SET) == -1 || !(buf = malloc(DELTA_CHUNK * BLOCKSIZE)))
+        goto out;
+    for (u32 i = 0; i < h.nruns; i++) {
+        assert(!full_read(fd, &r, sizeof r));
+        for (u32 j = 0; j < r.len; j += DELTA_CHUNK) {
+            u32 cnt = r.len - j < DELTA_CHUNK ? r.len - j : DELTA_CHUNK;
+            assert(!full_read(fd, buf, cnt * BLOCKSIZE));
+            assert(pwrite(vd, buf, cnt * BLOCKSIZE, (off_t)(r.start + j) * BLOCKSIZE) == cnt * BLOCKSIZE);
+        }
     }
+    ret = fsync(vd) ? -1 : h.nblocks;
+out:
+    free(buf);
+    close(vd);
+    return ret;
+}
+
+// Load the checksum blocks into memory
+static void load_csums(struct FileSystem *fs)
+{
+    assert((fs->csum = calloc(fs->su.nblock_csum * NCSUMS_PER_BLOCK, sizeof(u32))));
+    for (int i = 0; i < fs->su.nblock_csum; i++)
+        disk_read(fs, fs->su.scsum + i, &fs->csum[i * NCSUMS_PER_BLOCK]);
+}
+
+// Allocate the generation table, reading it in unless just formatted
+static void load_cbt(struct FileSystem *fs, int fresh)
+{
+    if (!(fs->su.features & FEAT_CBT))
+        return;
+    assert((fs->gen = calloc(fs->su.nblock_gen * NPTRS_PER_BLOCK, sizeof(u32))));
+    assert((fs->gdirty = calloc(fs->su.nblock_gen, 1)));
+    for (u32 i = 0; !fresh && i < fs->su.nblock_gen; i++)
+        block_read(fs, fs->su.sgen + i, &fs->gen[i * NPTRS_PER_BLOCK]);
+}
+
+/**
+ * @brief Get the image ready for a new file system with layout 'su'
+ * 
+ * Truncating the image and extending it back gives an all-zero (sparse)
+ * image for the cost of a metadata update, whatever its size. If that fails,
+ * as it does on a block device, the metadata sections are zeroed with large
+ * writes instead, except for the inode table (see FEAT_LAZY_ITABLE). Data
+ * blocks are never zeroed here: they are written in full when allocated.
+ */
+static void format_zero(struct FileSystem *fs, struct superblock *su)
+{
+    off_t size = (off_t)su->nblock_tot * BLOCKSIZE;
+    if (!ftruncate(fs->vd, 0) && !ftruncate(fs->vd, size))
+        return;
+    u32 n = 64;
+    char *zeros = calloc(n, BLOCKSIZE);
+    assert(zeros);
+    u32 ranges[2][2] = {
+        { 0, su->sinode },                  // reserved blocks, superblock and log
+        { su->sbitmap, su->sdata },         // bitmap, refcount and checksum blocks
+    };
+    for (int r = 0; r < 2; r++)
+        for (u32 i = ranges[r][0]; i < ranges[r][1]; i += n) {
+            u32 cnt = ranges[r][1] - i < n ? ranges[r][1] - i : n;
+            assert(pwrite(fs->vd, zeros, cnt * BLOCKSIZE, (off_t)i * BLOCKSIZE) == cnt * BLOCKSIZE);
+        }
+    free(zeros);
+}
 
-    if ((fs.vd = open(vhd, O_RDWR, 0644)) == -1) {
+/**
+ * @brief Mount the image at 'vhd', formatting it if it holds no file system
+ * 
+ * @param vhd The path of the image.
+ * @param log The path of the log file, truncated.
+ * @return struct FileSystem* The handle to pass to every other call,
+ *         or NULL on failure. Release it with fs_exit().
+ */
+struct FileSystem *fs_init(const char *vhd, const char *log) {
+    struct FileSystem *fs = calloc(1, sizeof *fs);
+    if (!fs)
+        return 0;
+    fs->dvd = -1;
+    if (!(fs->log = fopen(log, "w"))) {
+        perror("fopen");
+        free(fs);
+        return 0;
+    }
+    if ((fs->vd = open(vhd, O_RDWR, 0644)) == -1) {
         perror("open");
-        exit(1);
+        fclose(fs->log);
+        free(fs);
+        return 0;
     }
+    assert((fs->path = strdup(vhd)));
     // Read super block
     union block b;
-    disk_read(SUBLOCK_NUM, &b);
+    disk_read(fs, SUBLOCK_NUM, &b);
     // fs already installed
     if (b.su.magic == FSMAGIC) {
+        // Inodes of other revisions have a different layout
+        if (b.su.rev != FSREV) {
+            fprintf(stderr, "unsupported inode revision %u\n", b.su.rev);
+            close(fs->vd);
+            fclose(fs->log);
+            free(fs->path);
+            free(fs);
+            return 0;
+        }
         // Save a copy of on-disk super block in memory
-        fs.su = b.su;
-        printsu();
-        return;
+        fs->su = b.su;
+        load_csums(fs);
+        load_cbt(fs, 0);
+        assert((fs->hint = calloc(fs->su.ninodes, sizeof(u32))));
+        cache_init(fs);
+        bmcache_init(fs);
+        locks_init(fs);
+        // Now that the checksums are in, check the superblock we started from
+        if (csum_verify(fs, SUBLOCK_NUM, &b)) {
+            fprintf(stderr, "checksum mismatch on the superblock\n");
+            // Leave it as it is (see fs_exit())
+            fs->su.clean = 1;
+            fs_exit(fs);
+            return 0;
+        }
+        // Counters left by a crash, or by a version without them, are recounted
+        if (!fs->su.clean) {
+            usage_scan(fs, &fs->su);
+            mylog(fs, "usage counters rebuilt\n");
+            // So are the block generations: have every block exported again
+            for (u32 i = 0; fs->gen && i < fs->su.nblock_tot; i++)
+                cbt_mark(fs, i);
+        }
+        printsu(fs);
+        // Until fs_exit(), the counters on disk may lag behind
+        fs->su.clean = 0;
+        write_su(fs);
+        flusher_start(fs);
+        return fs;
     }
     // Format vhd
-    // Zero the entire disk
-    char buf[BLOCKSIZE] = {0};
-    for (int i = 0; i < NBLOCKS_TOT; i++)
-        disk_write(i, buf);
     // Prep super block
+    memset(&b, 0, sizeof b);
     b.su.ninodes = NINODES;
     b.su.nblock_tot = NBLOCKS_TOT;
     b.su.nblock_res = NBLOCKS_RES;
     b.su.nblock_log = NBLOCKS_LOG;
     b.su.nblock_inode = NINODES / NINODES_PER_BLOCK;
-    b.su.nblock_dat = NBLOCKS_TOT - (NBLOCKS_RES + NBLOCKS_LOG + b.su.nblock_inode + 1 + 1);
+    // There is a checksum and a generation for each block on the disk. The
+    // refcount blocks cover the blocks left after the other sections; the data
+    // section gets whatever remains after the refcount blocks.
+    b.su.nblock_csum = (NBLOCKS_TOT + NCSUMS_PER_BLOCK - 1) / NCSUMS_PER_BLOCK;
+    b.su.nblock_gen = (NBLOCKS_TOT + NPTRS_PER_BLOCK - 1) / NPTRS_PER_BLOCK;
+    u32 left = NBLOCKS_TOT - (NBLOCKS_RES + NBLOCKS_LOG + b.su.nblock_inode + 1 + 1 + b.su.nblock_csum + b.su.nblock_gen);
+    b.su.nblock_refcnt = (left + NREFS_PER_BLOCK - 1) / NREFS_PER_BLOCK;
+    b.su.nblock_dat = left - b.su.nblock_refcnt;
     b.su.slog = NBLOCKS_RES + 1; // 65
     b.su.sinode = b.su.slog + NBLOCKS_LOG; // 65 + 30
     b.su.sbitmap = b.su.sinode + b.su.nblock_inode;
-    b.su.sdata = b.su.sbitmap + 1;
+    b.su.srefcnt = b.su.sbitmap + 1;
+    b.su.scsum = b.su.srefcnt + b.su.nblock_refcnt;
+    b.su.sgen = b.su.scsum + b.su.nblock_csum;
+    b.su.sdata = b.su.sgen + b.su.nblock_gen;
     b.su.magic = FSMAGIC;
+    b.su.features = (CSUM_DATA ? FEAT_CSUM_DATA : 0) | FEAT_LAZY_ITABLE | FEAT_CBT;
+    b.su.rev = FSREV;
+    b.su.itable_init = 0;
+    b.su.nfree = b.su.nblock_dat / 8 * 8;
+    b.su.nifree = NINODES;
+    b.su.gen = 1;
+    format_zero(fs, &b.su);
+    // Save a copy in memory. The checksum blocks were just
+    // zeroed, so nothing is checksummed yet.
+    fs->su = b.su;
+    assert((fs->csum = calloc(fs->su.nblock_csum * NCSUMS_PER_BLOCK, sizeof(u32))));
+    load_cbt(fs, 1);
+    assert((fs->hint = calloc(fs->su.ninodes, sizeof(u32))));
+    cache_init(fs);
+    bmcache_init(fs);
+    locks_init(fs);
     // Write super block to disk
-    disk_write(SUBLOCK_NUM, &b);
-    // Save a copy in memory
-    fs.su = b.su;
-    printsu();
+    disk_write(fs, SUBLOCK_NUM, &b);
+    printsu(fs);
     // Reserve inode 0 and 1
-    alloc_inode(T_DIR);
-    alloc_inode(T_DIR);
+    alloc_inode(fs, T_DIR);
+    alloc_inode(fs, T_DIR);
+    flusher_start(fs);
+    return fs;
+}
+
+/**
+ * @brief Mount the image at 'vhd' read-only, mapped shared
+ * 
+ * All the processes mounting an image this way share one copy of it in the
+ * host page cache, and file data is copied from there straight to the
+ * caller. Mounting takes a single read: nothing is written, checked or
+ * recounted, and the checksum table is used in place. Calls that would
+ * modify the image fail, and reading files and directories takes no locks,
+ * so any number of threads can share the handle. The image must not change
+ * while mounted this way.
+ * 
+ * @param vhd The path of the image, which must hold a file system.
+ * @param log The path of the log file, truncated, or NULL for none.
+ * @return struct FileSystem* The handle, or NULL on failure. Release it with fs_exit().
+ */
+struct FileSystem *fs_init_rdonly(const char *vhd, const char *log)
+{
+    struct FileSystem *fs = calloc(1, sizeof *fs);
+    union block b;
+    if (!fs)
+        return 0;
+    fs->dvd = -1;
+    if (log && !(fs->log = fopen(log, "w"))) {
+        perror("fopen");
+        free(fs);
+        return 0;
+    }
+    if ((fs->vd = open(vhd, O_RDONLY)) == -1) {
+        perror("open");
+        goto fail;
+    }
+    if (pread(fs->vd, &b, BLOCKSIZE, (off_t)SUBLOCK_NUM * BLOCKSIZE) != BLOCKSIZE ||
+        b.su.magic != FSMAGIC || b.su.rev != FSREV) {
+        fprintf(stderr, "no file system of revision %u on %s\n", FSREV, vhd);
+        goto fail;
+    }
+    fs->su = b.su;
+    void *map = mmap(0, (size_t)fs->su.nblock_tot * BLOCKSIZE, PROT_READ, MAP_SHARED, fs->vd, 0);
+    if (map == MAP_FAILED) {
+        perror("mmap");
+        goto fail;
+    }
+    fs->map = map;
+    fs->csum = (u32 *)(fs->map + (size_t)fs->su.scsum * BLOCKSIZE);
+    if (csum_verify(fs, SUBLOCK_NUM, &b)) {
+        fprintf(stderr, "checksum mismatch on the superblock\n");
+        goto fail;
+    }
+    assert((fs->hint = calloc(fs->su.ninodes, sizeof(u32))));
+    cache_init(fs);
+    locks_init(fs);
+    printsu(fs);
+    return fs;
+fail:
+    if (fs->map)
+        munmap(fs->map, (size_t)fs->su.nblock_tot * BLOCKSIZE);
+    if (fs->vd != -1)
+        close(fs->vd);
+    if (fs->log)
+        fclose(fs->log);
+    free(fs);
+    return 0;
+}
+
+/**
+ * @brief Is the file system mounted read-only (see fs_init_rdonly())?
+ */
+int fs_rdonly(struct FileSystem *fs)
+{
+    return !!fs->map;
+}
+
+/**
+ * @brief Turn direct I/O on or off (see direct_rw())
+ * 
+ * While on, reads and writes of at least DIRECT_MIN bytes at block-aligned
+ * offsets, from and to block-aligned buffers, bypass every cache for the
+ * data of plain regular files.
+ * 
+ * @return int 0 on success, -1 if the image cannot be opened O_DIRECT (as on
+ *         some file systems) or the mount is read-only.
+ */
+int fs_direct(struct FileSystem *fs, int on)
+{
+    int ret = 0;
+    if (fs->map)
+        return -1;
+    fs_lock(fs, 1);
+    if (on && fs->dvd < 0) {
+        if ((fs->dvd = open(fs->path, O_RDWR | O_DIRECT)) < 0)
+            ret = -1;
+    } else if (!on && fs->dvd >= 0) {
+        close(fs->dvd);
+        fs->dvd = -1;
+    }
+    fs_unlock(fs);
+    return ret;
+}
+
+/**
+ * @brief Flush and unmount a file system, and free its handle
+ * 
+ * The file layer must have released its state (fs_files()) first.
+ */
+void fs_exit(struct FileSystem *fs)
+{
+    flusher_stop(fs);
+    fs_sync(fs);
+    // Mounted, the image is marked unclean: now its counters are up to date
+    if (!fs->map && !fs->su.clean) {
+        fs->su.clean = 1;
+        write_su(fs);
+        cbt_flush(fs);
+    }
+    locks_destroy(fs);
+    free(fs->pages);
+    free(fs->npages);
+    free(fs->nneed);
+    free(fs->wberr);
+    free(fs->hint);
+    if (fs->map)
+        munmap(fs->map, (size_t)fs->su.nblock_tot * BLOCKSIZE);
+    else
+        free(fs->csum);
+    free(fs->bmcache);
+    free(fs->mgen);
+    free(fs->gen);
+    free(fs->gdirty);
+    free(fs->fphead);
+    free(fs->fpnext);
+    free(fs->fpval);
+    if (fs->dvd >= 0)
+        close(fs->dvd);
+    free(fs->path);
+    close(fs->vd);
+    if (fs->log)
+        fclose(fs->log);
+    free(fs);
+}
+
+/**
+ * @brief Slot where the file layer keeps its per-file-system state
+ */
+void **fs_files(struct FileSystem *fs)
+{
+    return &fs->files;
 }
@@ -13,7 +13,7 @@
 
 // Disk layout
 //
-// reserved (for booting) (s0) | super block (s64) | log blocks (s65) | inode blocks (s95) | bitmap block (s120) | data blocks (s121)
+// reserved (for booting) (s0) | super block (s64) | log blocks (s65) | inode blocks (s95) | bitmap block (s120) | refcount blocks (s121) | checksum blocks (s125) | generation blocks (s133) | data blocks (s141)
 
 // Fixed disk parameters
 #define BLOCKSIZE 512
@@ -25,8 +25,31 @@
 #define SUBLOCK_NUM NBLOCKS_RES // super block starts immediately after the reserved blocks
 #define NINODES 200
 #define FSMAGIC 0xdeadbeef
+#define FSREV 1 // On-disk inode revision: 64-bit sizes and a triply-indirect pointer
+#define CSUM_DATA 0 // Checksum file data blocks too (recorded as FEAT_CSUM_DATA)
 #define NULLINUM 0
 #define ROOTINUM 1 // root directory inode number
+#define NSNAPSHOTS 8
+#define MAXNAME 14
+
+// A snapshot is a frozen copy of the inode table. Its 'root' block holds
+// pointers to the copied inode blocks, whose inodes share data and indirect
+// blocks with the live tree until one side modifies them (copy-on-write).
+struct snapshot {
+    char name[MAXNAME]; // empty if the slot is unused
+    u16 pad;
+    u32 root;
+};
+
+// Inode types
+#define T_REG 1
+#define T_DIR 2
+#define T_DEV 3
+
+// Feature flags
+#define FEAT_CSUM_DATA 1 // File data blocks are checksummed, not just metadata
+#define FEAT_LAZY_ITABLE 2 // Inode blocks from itable_init on have never been written and read as zeros
+#define FEAT_CBT 4 // The generation blocks record the generation each block was last written in
 
 struct superblock {
     // Hardcored disk and fs parameters
@@ -37,34 +60,73 @@ struct superblock {
     u32 nblock_dat;
     // Derived fs parameters
     u32 nblock_inode;
+    u32 nblock_refcnt;
+    u32 nblock_csum;
     // Start block of each disk section
     u32 slog;
     u32 sinode;
     u32 sbitmap;
+    u32 srefcnt;
+    u32 scsum;
     u32 sdata;
     u32 magic;
+    u32 features;
+    u32 rev;
+    struct snapshot snaps[NSNAPSHOTS];
+    u32 itable_init; // Inode blocks initialized so far (FEAT_LAZY_ITABLE)
+    // Usage counters, kept up to date by the allocators
+    u32 clean;              // Unmounted cleanly: the counters can be trusted
+    u32 nfree;              // Free data blocks
+    u32 nifree;             // Free inodes
+    u32 ntype[T_DEV+1];     // Allocated inodes of each type, indexed by T_*
+    // Changed-block tracking (FEAT_CBT)
+    u32 sgen;
+    u32 nblock_gen;
+    u32 gen;                // Current generation, bumped by each fs_sync()
+};
+
+// Usage summary returned by fs_statfs()
+struct fsstat {
+    u32 nblocks;            // Data blocks
+    u32 nfree;              // Free data blocks
+    u32 ninodes;
+    u32 nifree;             // Free inodes
+    u32 ntype[T_DEV+1];     // Allocated inodes of each type, indexed by T_*
 };
 
 #define NINODES_PER_BLOCK       (BLOCKSIZE/sizeof(struct dinode))
 #define NDIRENTS_PER_BLOCK      (BLOCKSIZE/sizeof(struct dirent))
 #define NPTRS_PER_BLOCK         (BLOCKSIZE/sizeof(u32))
+#define NREFS_PER_BLOCK         (BLOCKSIZE/sizeof(u16))
+#define NCSUMS_PER_BLOCK        (BLOCKSIZE/sizeof(u32))
 
-// #direct, indirect, and doubly-indirect, and total pointers in an inode
-#define NDIRECT                 10
+// #direct, indirect, doubly-indirect, triply-indirect, and total pointers in an inode
+#define NDIRECT                 8
 #define NINDRECT                2
 #define NDINDRECT               1
-#define NPTRS                   (NDIRECT+NINDRECT+NDINDRECT)
+#define NTINDRECT               1
+#define NPTRS                   (NDIRECT+NINDRECT+NDINDRECT+NTINDRECT)
+
+// The largest file, all of whose blocks the pointers of an inode map
+#define MAXFILE_BLOCKS          ((u64)NDIRECT + NINDRECT*NPTRS_PER_BLOCK + \
+                                 NDINDRECT*NPTRS_PER_BLOCK*NPTRS_PER_BLOCK + \
+                                 NTINDRECT*NPTRS_PER_BLOCK*NPTRS_PER_BLOCK*NPTRS_PER_BLOCK)
+#define MAXFILE_BYTES           (MAXFILE_BLOCKS*BLOCKSIZE)
+
+// Regular file flags
+#define I_COMPRESSED 1 // Data is stored in compressed clusters
+#define I_CONTIG 2 // Blocks lie in one run, allocated up front (see inode_reserve())
 
-#define T_REG 1
-#define T_DIR 2
-#define T_DEV 3
 // On-disk inode sturcture
 struct dinode {
     u16 type;
-    u16 major;
+    union {
+        u16 major;  // T_DEV: major device number
+        u16 flags;  // T_REG: I_* flags
+    };
     u16 minor;
     u16 linkcnt;
-    u32 size;
+    u64 size;
     u32 ptrs[NPTRS];
 };
 
@@ -74,24 +136,73 @@ struct dinode {
 // These directory entries contain the inode number of the file they point to,
 // allowing us to access the file content, as well as the associated file name.
 // This structure enables file retrieval by path.
-#define MAXNAME 14
 struct dirent {
     u16 inum;
     char name[MAXNAME];
 };
 
+// Changed-block delta written by fs_delta_export(): a header followed by
+// 'nruns' runs of consecutive blocks, each a struct delta_run and its blocks
+#define DELTAMAGIC 0x544c4544 // "DELT"
+
+struct delta_hdr {
+    u32 magic;
+    u32 from;               // Blocks written in generations before this one are left out
+    u32 to;                 // Generation of the image exported
+    u32 nblock_tot;
+    u32 nruns;
+    u32 nblocks;
+};
+
+struct delta_run {
+    u32 start;
+    u32 len;
+};
+
 union block {
     struct superblock su;
     u8  bytes[BLOCKSIZE];
     u32 ptrs[NPTRS_PER_BLOCK];
+    u16 refs[NREFS_PER_BLOCK];
+    u32 csums[NCSUMS_PER_BLOCK];
     struct dinode inodes[NINODES_PER_BLOCK];
     struct dirent dirents[NDIRENTS_PER_BLOCK];
 };
 
-void fs_init(const char *vhd);
-u32 alloc_inode(u16 type);
-int free_inode(u32 n);
-int read_inode(u32 n, struct dinode *p);
-int write_inode(u32 n, struct dinode *p);
-u32 inode_read(u32 n, void *buf, u32 sz, u32 off);
-u32 inode_write(u32 n, void *buf, u32 sz, u32 off);
+// A mounted image. All of its state hangs off the handle, so a process
+// can work on several images at once, from as many threads as it likes.
+struct FileSystem;
+
+struct FileSystem *fs_init(const char *vhd, const char *log);
+struct FileSystem *fs_init_rdonly(const char *vhd, const char *log);
+int fs_rdonly(struct FileSystem *fs);
+int fs_direct(struct FileSystem *fs, int on);
+void fs_exit(struct FileSystem *fs);
+void **fs_files(struct FileSystem *fs);
+u32 alloc_inode(struct FileSystem *fs, u16 type);
+int free_inode(struct FileSystem *fs, u32 n);
+int read_inode(struct FileSystem *fs, u32 n, struct dinode *p);
+int write_inode(struct FileSystem *fs, u32 n, struct dinode *p);
+u32 inode_read(struct FileSystem *fs, u32 n, void *buf, u32 sz, u64 off);
+u32 inode_write(struct FileSystem *fs, u32 n, void *buf, u32 sz, u64 off);
+int inode_clone(struct FileSystem *fs, u32 dst, u32 src);
+int inode_setflags(struct FileSystem *fs, u32 n, u16 flags);
+int inode_reserve(struct FileSystem *fs, u32 n, u64 size);
+int inode_extent(struct FileSystem *fs, u32 n, u32 *start, u32 *len);
+void inode_hint(struct FileSystem *fs, u32 n, u32 parent);
+int fs_snapshot_create(struct FileSystem *fs, const char *name);
+int fs_snapshot_delete(struct FileSystem *fs, const char *name);
+int fs_snapshot_rollback(struct FileSystem *fs, const char *name);
+int fs_snapshot_list(struct FileSystem *fs, char names[][MAXNAME], int n);
+int fs_scrub(struct FileSystem *fs, u32 *nchecked);
+u32 fs_dedup(struct FileSystem *fs, int on);
+int fs_sync(struct FileSystem *fs);
+int fs_fsync(struct FileSystem *fs, u32 n);
+void fs_writeback(struct FileSystem *fs, u32 age, u32 ratio);
+void fs_iostat(struct FileSystem *fs, u64 *nread, u64 *nwritten);
+void fs_check(struct FileSystem *fs);
+void fs_statfs(struct FileSystem *fs, struct fsstat *st);
+u32 fs_generation(struct FileSystem *fs);
+int fs_delta_export(struct FileSystem *fs, u32 since, int fd);
+int fs_delta_apply(const char *vhd, int fd);
+int fs_defrag(struct FileSystem *fs, int pack, void (*report)(u32 inum, u32 nblocks, u32 before, u32 after));
@@ -0,0 +1,165 @@
+/**
+ * @file lz.c
+ * @brief A small LZ77 block codec used for compressed files
+ *
+ * The format follows the LZ4 block format. The compressed stream is a series
+ * of sequences, each made of:
+ *
+ *   token | [literal length bytes] | literals | offset | [match length bytes]
+ *
+ * The high nibble of the token is the number of literals and the low nibble
+ * the match length minus LZ_MINMATCH. A nibble of 15 means more length bytes
+ * follow, each adding its value, until one below 255. The offset is a 16-bit
+ * little-endian distance back into the output. The last sequence holds only
+ * literals and stops right after them.
+ */
+
+#include "lz.h"
+
+#include <string.h>
+
+#define LZ_MINMATCH 4
+#define LZ_HASHBITS 12
+#define LZ_MAXOFF   0xffff
+
+static u32 lz_hash(const u8 *p)
+{
+    u32 v;
+    memcpy(&v, p, sizeof v);
+    return (v * 2654435761u) >> (32 - LZ_HASHBITS);
+}
+
+// Append the extra bytes of a length whose nibble is 15.
+// Return the new output position or 0 if out of room.
+static u8 *put_len(u8 *op, u8 *oend, u32 len)
+{
+    for (; len >= 255; len -= 255) {
+        if (op >= oend)
+            return 0;
+        *op++ = 255;
+    }
+    if (op >= oend)
+        return 0;
+    *op++ = len;
+    return op;
+}
+
+// Emit one sequence. 'mlen' is 0 for the final, literals-only sequence.
+static u8 *put_seq(u8 *op, u8 *oend, const u8 *lit, u32 nlit, u32 off, u32 mlen)
+{
+    u32 ml = mlen ? mlen - LZ_MINMATCH : 0;
+    if (op >= oend)
+        return 0;
+    u8 *token = op++;
+    *token = (nlit < 15 ? nlit : 15) << 4 | (ml < 15 ? ml : 15);
+    if (nlit >= 15 && !(op = put_len(op, oend, nlit - 15)))
+        return 0;
+    if (nlit > oend - op)
+        return 0;
+    memcpy(op, lit, nlit);
+    op += nlit;
+    if (!mlen)
+        return op;
+    if (oend - op < 2)
+        return 0;
+    *op++ = off & 0xff;
+    *op++ = off >> 8;
+    if (ml >= 15 && !(op = put_len(op, oend, ml - 15)))
+        return 0;
+    return op;
+}
+
+/**
+ * @brief Compress a buffer
+ * 
+ * @param src The data to be compressed.
+ * @param n The size of the data.
+ * @param dst The buffer receiving the compressed stream.
+ * @param cap The capacity of 'dst'.
+ * @return u32 The compressed size, or 0 if it would not fit in 'cap' bytes.
+ */
+u32 lz_compress(const u8 *src, u32 n, u8 *dst, u32 cap)
+{
+    int table[1 << LZ_HASHBITS];
+    u8 *op = dst;
+    u8 *oend = dst + cap;
+    u32 ip = 0;
+    u32 anchor = 0;
+    memset(table, -1, sizeof table);
+    while (ip + LZ_MINMATCH <= n) {
+        u32 h = lz_hash(src + ip);
+        int ref = table[h];
+        table[h] = ip;
+        if (ref < 0 || ip - ref > LZ_MAXOFF || memcmp(src + ref, src + ip, LZ_MINMATCH)) {
+            ip++;
+            continue;
+        }
+        u32 mlen = LZ_MINMATCH;
+        while (ip + mlen < n && src[ref + mlen] == src[ip + mlen])
+            mlen++;
+        if (!(op = put_seq(op, oend, src + anchor, ip - anchor, ip - ref, mlen)))
+            return 0;
+        ip += mlen;
+        anchor = ip;
+    }
+    if (!(op = put_seq(op, oend, src + anchor, n - anchor, 0, 0)))
+        return 0;
+    return op - dst;
+}
+
+// Read the extra bytes of a length whose nibble is 15
+static const u8 *get_len(const u8 *ip, const u8 *iend, u32 *len)
+{
+    u8 c;
+    do {
+        if (ip >= iend)
+            return 0;
+        c = *ip++;
+        *len += c;
+    } while (c == 255);
+    return ip;
+}
+
+/**
+ * @brief Decompress a buffer produced by lz_compress()
+ * 
+ * @param src The compressed stream.
+ * @param n The size of the compressed stream.
+ * @param dst The buffer receiving the decompressed data.
+ * @param cap The capacity of 'dst'.
+ * @return u32 The decompressed size, or 0 if the stream is corrupt.
+ */
+u32 lz_decompress(const u8 *src, u32 n, u8 *dst, u32 cap)
+{
+    const u8 *ip = src;
+    const u8 *iend = src + n;
+    u32 op = 0;
+    while (ip < iend) {
+        u8 token = *ip++;
+        u32 nlit = token >> 4;
+        if (nlit == 15 && !(ip = get_len(ip, iend, &nlit)))
+            return 0;
+        if (nlit > iend - ip || nlit > cap - op)
+            return 0;
+        memcpy(dst + op, ip, nlit);
+        ip += nlit;
+        op += nlit;
+        // The final sequence ends right after its literals
+        if (ip == iend)
+            break;
+        if (iend - ip < 2)
+            return 0;
+        u32 off = ip[0] | ip[1] << 8;
+        ip += 2;
+        u32 mlen = token & 15;
+        if (mlen == 15 && !(ip = get_len(ip, iend, &mlen)))
+            return 0;
+        mlen += LZ_MINMATCH;
+        if (!off || off > op || mlen > cap - op)
+            return 0;
+        // Byte by byte: the match may overlap the bytes it produces
+        for (u32 i = 0; i < mlen; i++, op++)
+            dst[op] = dst[op - off];
+    }
+    return op;
+}
@@ -0,0 +1,9 @@
+/**
+ * @file lz.h
+ * @brief A small LZ77 block codec used for compressed files
+ */
+
+#include "types.h"
+
+u32 lz_compress(const u8 *src, u32 n, u8 *dst, u32 cap);
+u32 lz_decompress(const u8 *src, u32 n, u8 *dst, u32 cap);
@@ -9,10 +9,14 @@
  * 
  */
 
+#define _GNU_SOURCE // nftw()
+
 #include "fs.h"
 #include "file.h"
 
+#include <ftw.h>
 #include <time.h>
+#include <limits.h>
 #include <fcntl.h>
 #include <stdio.h>
 #include <ctype.h>
@@ -20,9 +24,18 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <pthread.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
 
+// The image given on the command line
+static struct FileSystem *fs;
+
+// With direct I/O on, files are copied in and out in large aligned chunks,
+// which the file system transfers without caching (see fs_direct())
+static int direct;
+static char chunk[64 * BLOCKSIZE] __attribute__((aligned(BLOCKSIZE)));
+
 static int arg_len(char *arg) {
     for (int i = 0; ; i++)
         if (!arg[i] || arg[i] == ' ')
@@ -60,57 +73,81 @@ static int parse_args(char *buf, char *args[], int argct) {
     return cnt;
 }
 
-static void cmd_ls(char *path) {
+static void cmd_ls(char *path, int longfmt) {
     int fd;
     if (!path)
         return;
-    if ((fd = myfs_open(path, O_RDONLY)) == -1) {
+    if ((fd = myfs_open(fs, path, O_RDONLY)) == -1) {
         fprintf(stderr, "myfs_open failed\n");
         return;
     }
-    struct dirent de;
-    while (myfs_read(fd, &de, sizeof de)) {
-        if (!de.inum)
-            continue;
-        printf("%s\n", de.name);
+    struct dirent des[NDIRENTS_PER_BLOCK];
+    struct filestat sts[NDIRENTS_PER_BLOCK];
+    int n;
+    while ((n = myfs_readdir(fs, fd, des, NDIRENTS_PER_BLOCK, longfmt ? sts : 0)) > 0) {
+        for (int i = 0; i < n; i++) {
+            if (longfmt)
+                printf("%d %d %llu %s\n", sts[i].type, sts[i].linkcnt, sts[i].size, des[i].name);
+            else
+                printf("%s\n", des[i].name);
+        }
     }
-    assert(!myfs_close(fd));
+    if (n < 0)
+        fprintf(stderr, "myfs_readdir failed\n");
+    assert(!myfs_close(fs, fd));
 }
 
 static void cmd_mkdir(char *path) {
-    if (myfs_mknod(path, T_DIR)) {
+    if (myfs_mknod(fs, path, T_DIR)) {
         fprintf(stderr, "myfs_mkdir failed\n");
         return;
     }
 }
 
-static void cmd_migrate(char *mypath, char *hostpath) {
+static void cmd_migrate(char *mypath, char *hostpath, u16 flags) {
     int hostfd = open(hostpath, O_RDONLY, 0644);
     if (hostfd < 0) {
         fprintf(stderr, "%s not found in host fs\n", hostpath);
         return;
     }
     int myfd;
-    if (myfs_mknod(mypath, T_REG)) {
+    if (myfs_mknod(fs, mypath, T_REG)) {
         fprintf(stderr, "failed to create %s in myfs\n", mypath);
         return;
     }
-    assert((myfd = myfs_open(mypath, O_WRONLY)) >= 0);
-    char c;
+    assert((myfd = myfs_open(fs, mypath, O_WRONLY)) >= 0);
+    if (flags & I_CONTIG) {
+        struct stat st;
+        assert(!fstat(hostfd, &st));
+        if (myfs_reserve(fs, myfd, st.st_size)) {
+            fprintf(stderr, "no room for %s in one run\n", mypath);
+            close(hostfd);
+            myfs_close(fs, myfd);
+            myfs_unlink(fs, mypath);
+            return;
+        }
+    } else
+        assert(myfs_setflags(fs, myfd, flags) >= 0);
+    // Whole blocks, so that deduplication sees full blocks
+    char *buf = chunk;
+    int bufsz = direct ? sizeof chunk : BLOCKSIZE;
     for (;;) {
         int n;
-        assert((n = read(hostfd, &c, 1)) >= 0);
+        assert((n = read(hostfd, buf, bufsz)) >= 0);
         if (!n)
             break;
-        assert(myfs_write(myfd, &c, 1));
+        if (myfs_write(fs, myfd, buf, n) != n) {
+            fprintf(stderr, "myfs_write failed, %s is incomplete\n", mypath);
+            break;
+        }
     }
     assert(close(hostfd) >= 0);
-    assert(myfs_close(myfd) >= 0);
+    assert(myfs_close(fs, myfd) >= 0);
 }
 
 static void cmd_retrieve(char *hostpath, char *mypath) {
     int hostfd = open(hostpath, O_CREAT | O_TRUNC | O_WRONLY , 0644);
-    int myfd = myfs_open(mypath, O_RDONLY);
+    int myfd = myfs_open(fs, mypath, O_RDONLY);
     if (hostfd < 0) {
         perror("host open");
         return;
@@ -120,61 +157,77 @@ static void cmd_retrieve(char *hostpath, char *mypath) {
         close(hostfd);
         return;
     }
-    char c;
+    char *buf = chunk;
+    int bufsz = direct ? sizeof chunk : BLOCKSIZE;
     for (;;) {
         int n;
-        assert((n = myfs_read(myfd, &c, 1)) >= 0);
+        assert((n = myfs_read(fs, myfd, buf, bufsz)) >= 0);
         if (!n)
             break;
-        assert(write(hostfd, &c, 1));
+        assert(write(hostfd, buf, n) == n);
     }
     assert(close(hostfd) >= 0);
-    assert(myfs_close(myfd) >= 0);
+    assert(myfs_close(fs, myfd) >= 0);
+}
+
+static void cmd_clone(char *dst, char *src) {
+    if (myfs_clone(fs, dst, src)) {
+        fprintf(stderr, "myfs_clone failed\n");
+        return;
+    }
 }
 
 static void cmd_touch(char *path) {
-    if (myfs_mknod(path, T_REG)) {
+    if (myfs_mknod(fs, path, T_REG)) {
         fprintf(stderr, "myfs_mknod failed\n");
         return;
     }
 }
 
+static void cmd_rm(char *path) {
+    if (myfs_unlink(fs, path)) {
+        fprintf(stderr, "myfs_unlink failed\n");
+        return;
+    }
+}
+
 static void cmd_stat(char *path) {
     int fd;
-    if ((fd = myfs_open(path, O_WRONLY)) < 0) {
+    if ((fd = myfs_open(fs, path, O_WRONLY)) < 0) {
         fprintf(stderr, "myfs_open failed\n");
         return;
     }
     struct filestat st;
-    assert(myfs_stat(fd, &st) >= 0);
-    printf("type:%d\nsize:%d\nlinkcnt:%d\n", st.type, st.size, st.linkcnt);
+    assert(myfs_stat(fs, fd, &st) >= 0);
+    printf("type:%d\nsize:%llu\nlinkcnt:%d\nflags:%d\n", st.type, st.size, st.linkcnt, st.flags);
 }
 
-static void cmd_write(char *path, u32 off, u32 sz, char *words) {
+static void cmd_extent(char *path) {
     int fd;
-    if ((fd = myfs_open(path, O_WRONLY)) < 0) {
+    u32 start, len;
+    if ((fd = myfs_open(fs, path, O_RDONLY)) < 0) {
         fprintf(stderr, "myfs_open failed\n");
         return;
     }
-    assert(myfs_seek(fd, off) >= 0);
-    assert(myfs_write(fd, words, strlen(words)) == strlen(words));
-    assert(myfs_close(fd) >= 0);
+    if (myfs_extent(fs, fd, &start, &len))
+        printf("not contiguous\n");
+    else
+        printf("start:%u\nlen:%u\n", start, len);
+    assert(myfs_close(fs, fd) >= 0);
 }
 
-static void cmd_read(char *path, u32 off, u32 sz) {
+static void cmd_write(char *path, u64 off, u32 sz, char *words) {
     int fd;
-    if ((fd = myfs_open(path, O_RDONLY)) < 0) {
+    if ((fd = myfs_open(fs, path, O_WRONLY)) < 0) {
         fprintf(stderr, "myfs_open failed\n");
         return;
     }
-    char buf[BLOCKSIZE];
-    assert(myfs_seek(fd, off) >= 0);
-    int n = myfs_read(fd, buf, sz);
-    if (n < 0) {
-        printf("myfs_read failed\n");
-        assert(myfs_close(fd) >= 0);
-        return;
-    }
+    if (myfs_pwrite(fs, fd, words, strlen(words), off) != strlen(words))
+        fprintf(stderr, "myfs_write failed\n");
+    assert(myfs_close(fs, fd) >= 0);
+}
+
+static void print_data(char *buf, int n) {
     for (int i = 0; i < n; i++) {
         if (isprint(buf[i]))
             printf("%c", buf[i]);
@@ -184,17 +237,777 @@ static void cmd_read(char *path, u32 off, u32 sz) {
             printf("\\?");
     }
     puts("");
-    assert(myfs_close(fd) >= 0);
+}
+
+static void cmd_read(char *path, u64 off, u32 sz) {
+    int fd;
+    if ((fd = myfs_open(fs, path, O_RDONLY)) < 0) {
+        fprintf(stderr, "myfs_open failed\n");
+        return;
+    }
+    char buf[BLOCKSIZE];
+    int n = myfs_pread(fs, fd, buf, sz, off);
+    if (n < 0) {
+        printf("myfs_read failed\n");
+        assert(myfs_close(fs, fd) >= 0);
+        return;
+    }
+    print_data(buf, n);
+    assert(myfs_close(fs, fd) >= 0);
+}
+
+// Descriptors kept open across commands, to exercise the offsets they share
+
+static void cmd_open(char *path) {
+    int fd = myfs_open(fs, path, O_RDWR);
+    if (fd < 0)
+        fprintf(stderr, "myfs_open failed\n");
+    else
+        printf("fd:%d\n", fd);
+}
+
+static void cmd_dup(int fd) {
+    int nfd = myfs_dup(fs, fd);
+    if (nfd < 0)
+        fprintf(stderr, "myfs_dup failed\n");
+    else
+        printf("fd:%d\n", nfd);
+}
+
+static void cmd_close(int fd) {
+    if (myfs_close(fs, fd))
+        fprintf(stderr, "myfs_close failed\n");
+}
+
+// Read at the offset of fd, or at 'off' with pread if pos is set
+static void cmd_fdread(int fd, u64 off, u32 sz, int pos) {
+    char buf[BLOCKSIZE];
+    sz = sz < BLOCKSIZE ? sz : BLOCKSIZE;
+    int n = pos ? myfs_pread(fs, fd, buf, sz, off) : myfs_read(fs, fd, buf, sz);
+    if (n < 0)
+        printf("myfs_read failed\n");
+    else
+        print_data(buf, n);
+}
+
+static void cmd_fdwrite(int fd, u64 off, char *words, int pos) {
+    int len = strlen(words);
+    if ((pos ? myfs_pwrite(fs, fd, words, len, off) : myfs_write(fs, fd, words, len)) != len)
+        fprintf(stderr, "myfs_write failed\n");
+}
+
+static void cmd_snapshot(char *op, char *name) {
+    if (!strcmp(op, "snapshot") && fs_snapshot_create(fs, name))
+        fprintf(stderr, "failed to create snapshot %s\n", name);
+    if (!strcmp(op, "snapdel") && fs_snapshot_delete(fs, name))
+        fprintf(stderr, "no such snapshot %s\n", name);
+    if (!strcmp(op, "rollback") && fs_snapshot_rollback(fs, name))
+        fprintf(stderr, "failed to roll back to %s\n", name);
+}
+
+static u32 frags_before, frags_after;
+
+static void defrag_report(u32 inum, u32 nblocks, u32 before, u32 after) {
+    printf("inode %u: %u blocks, %u -> %u fragments\n", inum, nblocks, before, after);
+    frags_before += before;
+    frags_after += after;
+}
+
+static void cmd_defrag(int pack) {
+    frags_before = frags_after = 0;
+    int moved = fs_defrag(fs, pack, defrag_report);
+    printf("moved:%d\nbefore:%u\nafter:%u\n", moved, frags_before, frags_after);
+}
+
+static void cmd_dedup(char *onoff) {
+    if (!strcmp(onoff, "on"))
+        fs_dedup(fs, 1);
+    else
+        printf("deduped:%u\n", fs_dedup(fs, 0));
+}
+
+static void cmd_fsync(char *path) {
+    int fd = myfs_open(fs, path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "%s not found in myfs\n", path);
+        return;
+    }
+    if (myfs_fsync(fs, fd))
+        fprintf(stderr, "fsync of %s failed\n", path);
+    myfs_close(fs, fd);
+}
+
+static void cmd_direct(char *onoff) {
+    int on = !strcmp(onoff, "on");
+    if (fs_direct(fs, on))
+        fprintf(stderr, "direct I/O not available on this image\n");
+    else
+        direct = on;
+}
+
+static void cmd_scrub() {
+    u32 checked;
+    int bad = fs_scrub(fs, &checked);
+    printf("checked:%u\nbad:%d\n", checked, bad);
+}
+
+static void cmd_df() {
+    struct fsstat st;
+    myfs_statfs(fs, &st);
+    printf("blocks:%u\nfree:%u\ninodes:%u\nifree:%u\nreg:%u\ndir:%u\ndev:%u\n",
+           st.nblocks, st.nfree, st.ninodes, st.nifree, st.ntype[T_REG], st.ntype[T_DIR], st.ntype[T_DEV]);
+}
+
+static void cmd_export(char *host_path, u32 since) {
+    int fd = open(host_path, O_CREAT | O_TRUNC | O_WRONLY, 0644);
+    if (fd == -1) {
+        perror("open");
+        return;
+    }
+    printf("exported:%d\n", fs_delta_export(fs, since, fd));
+    close(fd);
+}
+
+static void cmd_apply(char *vhd, char *host_path) {
+    int fd = open(host_path, O_RDONLY);
+    if (fd == -1) {
+        perror("open");
+        return;
+    }
+    printf("applied:%d\n", fs_delta_apply(vhd, fd));
+    close(fd);
+}
+
+static void cmd_snapshots() {
+    char names[NSNAPSHOTS][MAXNAME];
+    int n = fs_snapshot_list(fs, names, NSNAPSHOTS);
+    for (int i = 0; i < n; i++)
+        printf("%s\n", names[i]);
+}
+
+// Stress test: each thread does random positional reads and writes on a
+// file of its own, checked against a copy in memory, reads a file shared by
+// all threads, and creates and removes a scratch file. The fs is checked at
+// the end.
+#define STRESS_MAXTHREADS 16
+#define STRESS_SIZE (16 * BLOCKSIZE)
+
+static char stress_pattern(int i) {
+    return 'a' + i % 26;
+}
+
+struct stress_arg {
+    int id;
+    int nops;
+    int errors;
+};
+
+static void *stress_worker(void *p) {
+    struct stress_arg *a = p;
+    static char shadows[STRESS_MAXTHREADS][STRESS_SIZE];
+    char *shadow = shadows[a->id];
+    char path[MAXNAME];
+    char tmp[MAXNAME];
+    char buf[2 * BLOCKSIZE];
+    unsigned seed = a->id + 1;
+    u32 size = 0;
+    snprintf(path, sizeof path, "/st%d", a->id);
+    snprintf(tmp, sizeof tmp, "/st%dtmp", a->id);
+    assert(!myfs_mknod(fs, path, T_REG));
+    int fd = myfs_open(fs, path, O_RDWR);
+    int sfd = myfs_open(fs, "/stshared", O_RDONLY);
+    assert(fd >= 0 && sfd >= 0);
+    for (int i = 0; i < a->nops; i++) {
+        u32 len = 1 + rand_r(&seed) % sizeof buf;
+        u32 off = rand_r(&seed) % (STRESS_SIZE - len);
+        switch (rand_r(&seed) % 4) {
+        case 0:
+            for (int j = 0; j < len; j++)
+                buf[j] = rand_r(&seed);
+            if (myfs_pwrite(fs, fd, buf, len, off) != len)
+                a->errors++;
+            memcpy(shadow + off, buf, len);
+            size = off + len > size ? off + len : size;
+            break;
+        case 1: {
+            int n = myfs_pread(fs, fd, buf, len, off);
+            int want = off >= size ? 0 : off + len > size ? size - off : len;
+            if (n != want || memcmp(buf, shadow + off, want))
+                a->errors++;
+            break;
+        }
+        case 2:
+            if (myfs_pread(fs, sfd, buf, len, off) != len)
+                a->errors++;
+            for (int j = 0; j < len; j++)
+                if (buf[j] != stress_pattern(off + j))
+                    a->errors++;
+            break;
+        case 3: {
+            if (myfs_mknod(fs, tmp, T_REG)) {
+                a->errors++;
+                break;
+            }
+            int tfd = myfs_open(fs, tmp, O_RDWR);
+            if (tfd < 0 || myfs_write(fs, tfd, buf, len) != len || myfs_close(fs, tfd) || myfs_unlink(fs, tmp))
+                a->errors++;
+            break;
+        }
+        }
+    }
+    assert(!myfs_close(fs, fd) && !myfs_close(fs, sfd));
+    return 0;
+}
+
+static void cmd_stress(int nthreads, int nops) {
+    pthread_t tids[STRESS_MAXTHREADS];
+    struct stress_arg args[STRESS_MAXTHREADS];
+    char buf[STRESS_SIZE];
+    int errors = 0;
+    if (nthreads < 1 || nthreads > STRESS_MAXTHREADS) {
+        fprintf(stdout, "stress: at most %d threads\n", STRESS_MAXTHREADS);
+        return;
+    }
+    for (int i = 0; i < STRESS_SIZE; i++)
+        buf[i] = stress_pattern(i);
+    assert(!myfs_mknod(fs, "/stshared", T_REG));
+    int fd = myfs_open(fs, "/stshared", O_WRONLY);
+    assert(myfs_write(fs, fd, buf, STRESS_SIZE) == STRESS_SIZE);
+    assert(!myfs_close(fs, fd));
+    for (int i = 0; i < nthreads; i++) {
+        args[i] = (struct stress_arg){ .id = i, .nops = nops };
+        assert(!pthread_create(&tids[i], 0, stress_worker, &args[i]));
+    }
+    for (int i = 0; i < nthreads; i++) {
+        assert(!pthread_join(tids[i], 0));
+        errors += args[i].errors;
+    }
+    fs_sync(fs);
+    fs_check(fs);
+    printf("stress:%d\n", errors);
+}
+
+static void cmd_iostat() {
+    u64 rd, wr;
+    fs_iostat(fs, &rd, &wr);
+    printf("blocks read:%llu\nblocks written:%llu\n", rd, wr);
+}
+
+static void cmd_record(char *host_path) {
+    if (myfs_trace(fs, strcmp(host_path, "off") ? host_path : 0))
+        perror("trace");
+}
+
+// Replay: re-run the calls of a trace (see myfs_trace()) one after the
+// other, as fast as possible, on the image given on the command line, which
+// should be as fresh as the one recorded. Recorded descriptors are mapped
+// to the ones the replayed calls return. The data written is a fixed
+// pattern. Calls whose success differs from the recording are counted as
+// diverged. The run ends with a sync, which counts toward the elapsed time
+// and the blocks written.
+#define TR_NOPS (TR_LINK + 1)
+
+static const char *tr_names[TR_NOPS] = {
+    [TR_OPEN] = "open", [TR_CLOSE] = "close", [TR_READ] = "read", [TR_WRITE] = "write",
+    [TR_PREAD] = "pread", [TR_PWRITE] = "pwrite", [TR_SEEK] = "seek", [TR_MKNOD] = "mknod",
+    [TR_UNLINK] = "unlink", [TR_LINK] = "link",
+};
+
+static u64 now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int u64_cmp(const void *a, const void *b) {
+    u64 x = *(u64 *)a, y = *(u64 *)b;
+    return x < y ? -1 : x > y;
+}
+
+// Read the next path of a record, to be freed, or return NULL at the end of the trace
+static char *replay_path(FILE *f) {
+    u16 len;
+    if (fread(&len, sizeof len, 1, f) != 1)
+        return 0;
+    char *p = malloc(len + 1);
+    assert(p);
+    if (fread(p, 1, len, f) != len) {
+        free(p);
+        return 0;
+    }
+    p[len] = 0;
+    return p;
+}
+
+static void cmd_replay(char *host_path) {
+    FILE *f = fopen(host_path, "r");
+    struct trace_hdr h;
+    struct trace_rec r;
+    char *path[2] = { 0 };
+    u64 *lat[TR_NOPS] = { 0 };
+    u32 nlat[TR_NOPS] = { 0 }, maxlat[TR_NOPS] = { 0 };
+    int *fds = 0, nfds = 0;
+    char *buf = 0;
+    u32 bufsz = 0;
+    u64 nops = 0, diverged = 0, bytes = 0, rd0, wr0, rd, wr;
+    if (!f) {
+        perror("fopen");
+        return;
+    }
+    if (fread(&h, sizeof h, 1, f) != 1 || h.magic != TRACEMAGIC || h.recsize != sizeof r) {
+        fprintf(stderr, "%s is not a trace\n", host_path);
+        fclose(f);
+        return;
+    }
+    fs_iostat(fs, &rd0, &wr0);
+    u64 begin = now_ns();
+    while (fread(&r, sizeof r, 1, f) == 1) {
+        int bad = r.op < TR_OPEN || r.op > TR_LINK || r.npath > 2;
+        for (int i = 0; i < 2; i++) {
+            free(path[i]);
+            path[i] = 0;
+        }
+        for (int i = 0; !bad && i < r.npath; i++)
+            bad = !(path[i] = replay_path(f));
+        if (bad) {
+            fprintf(stderr, "%s: bad record after %llu\n", host_path, nops);
+            break;
+        }
+        // The descriptor this replay got where the recording got r.fd
+        int fd = r.fd >= 0 && r.fd < nfds ? fds[r.fd] : -1;
+        if (r.sz > bufsz) {
+            assert((buf = realloc(buf, r.sz)));
+            for (u32 i = bufsz; i < r.sz; i++)
+                buf[i] = 'a' + i % 26;
+            bufsz = r.sz;
+        }
+        int ret = 0;
+        u64 t = now_ns();
+        switch (r.op) {
+        case TR_OPEN: ret = myfs_open(fs, path[0], r.arg); break;
+        case TR_CLOSE: ret = myfs_close(fs, fd); break;
+        case TR_SEEK: ret = myfs_seek(fs, fd, r.off); break;
+        case TR_READ: ret = myfs_read(fs, fd, buf, r.sz); break;
+        case TR_WRITE: ret = myfs_write(fs, fd, buf, r.sz); break;
+        case TR_PREAD: ret = myfs_pread(fs, fd, buf, r.sz, r.off); break;
+        case TR_PWRITE: ret = myfs_pwrite(fs, fd, buf, r.sz, r.off); break;
+        case TR_MKNOD: ret = myfs_mknod(fs, path[0], r.arg); break;
+        case TR_UNLINK: ret = myfs_unlink(fs, path[0]); break;
+        case TR_LINK: ret = myfs_link(fs, path[0], path[1]); break;
+        }
+        t = now_ns() - t;
+        if (r.op == TR_OPEN && r.fd >= 0) {
+            if (r.fd >= nfds) {
+                int n = r.fd + 1 > nfds * 2 ? r.fd + 1 : nfds * 2;
+                assert((fds = realloc(fds, n * sizeof *fds)));
+                for (int i = nfds; i < n; i++)
+                    fds[i] = -1;
+                nfds = n;
+            }
+            fds[r.fd] = ret;
+        }
+        if (r.op == TR_CLOSE && fd >= 0)
+            fds[r.fd] = -1;
+        if (r.op >= TR_READ && r.op <= TR_PWRITE && ret > 0)
+            bytes += ret;
+        diverged += (ret < 0) != (r.ret < 0);
+        if (nlat[r.op] == maxlat[r.op]) {
+            maxlat[r.op] = maxlat[r.op] ? maxlat[r.op] * 2 : 64;
+            assert((lat[r.op] = realloc(lat[r.op], maxlat[r.op] * sizeof(u64))));
+        }
+        lat[r.op][nlat[r.op]++] = t;
+        nops++;
+    }
+    myfs_sync(fs);
+    double secs = (now_ns() - begin) / 1e9;
+    fs_iostat(fs, &rd, &wr);
+    fclose(f);
+    printf("replay:%llu\ndiverged:%llu\nsecs:%.6f\nops/s:%.0f\nMB/s:%.2f\nblocks read:%llu\nblocks written:%llu\n",
+           nops, diverged, secs, nops / secs, bytes / secs / 1e6, rd - rd0, wr - wr0);
+    // Latency percentiles of each kind of call, in microseconds
+    for (int op = TR_OPEN; op < TR_NOPS; op++) {
+        u32 n = nlat[op];
+        if (!n)
+            continue;
+        qsort(lat[op], n, sizeof(u64), u64_cmp);
+        printf("%s:%u p50:%.1f p90:%.1f p99:%.1f max:%.1f\n", tr_names[op], n,
+               lat[op][n / 2] / 1e3, lat[op][n * 9 / 10] / 1e3, lat[op][n * 99 / 100] / 1e3, lat[op][n - 1] / 1e3);
+        free(lat[op]);
+    }
+    free(path[0]);
+    free(path[1]);
+    free(fds);
+    free(buf);
+}
+
+// Import and extract: copy a whole host directory tree into myfs, or a myfs
+// tree out to the host, as a pipeline of three stages connected by bounded
+// queues, so that host and image I/O overlap and small files are handled
+// several at a time:
+//
+//   import:  read (host files, nthreads) -> meta (mknod/open, 1) -> write (myfs, nthreads)
+//   extract: meta (mkdir/open, 1) -> read (myfs files, nthreads) -> write (host, nthreads)
+//
+// The meta stage is a single thread since the calls that add directory
+// entries are serialized anyway. On extract it sees the tree in preorder,
+// so directories exist before what they contain. On import, files reach it
+// in whatever order the readers finish them, so the walker creates each
+// directory itself before queuing anything in it. Files are moved in chunks of
+// PIPE_CHUNK bytes; each file is read by one thread, in order, while its
+// chunks may be written by several. Blocks are allocated when the written
+// pages are flushed, per file and contiguously (see delayed allocation in
+// fs.c), so the write stage allocates as it goes. Each stage reports how
+// much went through it and how busy its threads were: the busiest is the
+// bottleneck.
+#define PIPE_CHUNK (64 * BLOCKSIZE)
+#define PIPE_QLEN 16
+#define PIPE_MAXTHREADS 16
+
+// Bounded FIFO, closed once all its producers are done
+struct pqueue {
+    void *items[PIPE_QLEN];
+    int head, n;
+    int producers;
+    pthread_mutex_t lock;
+    pthread_cond_t nonempty, nonfull;
+};
+
+// A file or directory to copy. The last chunk written closes the destination.
+struct pfile {
+    char *src, *dst;
+    int dir;
+    int sfd, dfd;
+    int refs;           // The reader's, and one per chunk not written yet
+    int failed;
+};
+
+struct pchunk {
+    struct pfile *f;
+    u64 off;
+    u32 len;
+    char *data;
+};
+
+struct pstage {
+    const char *name;
+    int nthreads;
+    u64 items, bytes;
+    u64 busy;           // ns spent working, summed over the threads
+};
+
+static struct pipeline {
+    int import;
+    struct pqueue q[3]; // Into each stage
+    struct pstage st[3];
+    int errors;
+    u64 nfiles;
+    const char *src, *dst;  // Roots of the trees
+} pipe_;
+
+static void pq_init(struct pqueue *q, int producers) {
+    q->head = q->n = 0;
+    q->producers = producers;
+    pthread_mutex_init(&q->lock, 0);
+    pthread_cond_init(&q->nonempty, 0);
+    pthread_cond_init(&q->nonfull, 0);
+}
+
+static void pq_destroy(struct pqueue *q) {
+    pthread_mutex_destroy(&q->lock);
+    pthread_cond_destroy(&q->nonempty);
+    pthread_cond_destroy(&q->nonfull);
+}
+
+static void pq_push(struct pqueue *q, void *item) {
+    pthread_mutex_lock(&q->lock);
+    while (q->n == PIPE_QLEN)
+        pthread_cond_wait(&q->nonfull, &q->lock);
+    q->items[(q->head + q->n++) % PIPE_QLEN] = item;
+    pthread_cond_signal(&q->nonempty);
+    pthread_mutex_unlock(&q->lock);
+}
+
+// Take the oldest item, or return NULL once the queue is closed and empty
+static void *pq_pop(struct pqueue *q) {
+    void *item = 0;
+    pthread_mutex_lock(&q->lock);
+    while (!q->n && q->producers)
+        pthread_cond_wait(&q->nonempty, &q->lock);
+    if (q->n) {
+        item = q->items[q->head];
+        q->head = (q->head + 1) % PIPE_QLEN;
+        q->n--;
+        pthread_cond_signal(&q->nonfull);
+    }
+    pthread_mutex_unlock(&q->lock);
+    return item;
+}
+
+// One of the producers is done
+static void pq_done(struct pqueue *q) {
+    pthread_mutex_lock(&q->lock);
+    if (!--q->producers)
+        pthread_cond_broadcast(&q->nonempty);
+    pthread_mutex_unlock(&q->lock);
+}
+
+static void pipe_account(struct pstage *st, u64 t, u64 bytes) {
+    __atomic_fetch_add(&st->busy, now_ns() - t, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&st->bytes, bytes, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&st->items, 1, __ATOMIC_RELAXED);
+}
+
+static void pipe_error(struct pfile *f, const char *what) {
+    fprintf(stderr, "%s -> %s: %s failed\n", f->src, f->dst, what);
+    __atomic_store_n(&f->failed, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&pipe_.errors, 1, __ATOMIC_RELAXED);
+}
+
+static struct pfile *pfile_new(const char *src, const char *dst, int dir) {
+    struct pfile *f = calloc(1, sizeof *f);
+    assert(f && (f->src = strdup(src)) && (f->dst = strdup(dst)));
+    f->dir = dir;
+    f->sfd = f->dfd = -1;
+    f->refs = 1;
+    pipe_.nfiles += !dir;
+    return f;
+}
+
+// Drop a reference, closing the destination with the last one
+static void pfile_put(struct pfile *f) {
+    if (__atomic_sub_fetch(&f->refs, 1, __ATOMIC_ACQ_REL))
+        return;
+    if (f->dfd >= 0)
+        pipe_.import ? myfs_close(fs, f->dfd) : close(f->dfd);
+    free(f->src);
+    free(f->dst);
+    free(f);
+}
+
+static struct pchunk *pchunk_new(struct pfile *f, u64 off) {
+    struct pchunk *c = malloc(sizeof *c);
+    assert(c && (c->data = aligned_alloc(BLOCKSIZE, PIPE_CHUNK)));
+    c->f = f;
+    c->off = off;
+    c->len = 0;
+    __atomic_fetch_add(&f->refs, 1, __ATOMIC_RELAXED);
+    return c;
+}
+
+// Read stage: split the file into chunks, reading from the host (import)
+// or from myfs (extract). Directories go through as a chunk without data.
+static void pipe_read(struct pfile *f, struct pqueue *out) {
+    struct pstage *st = &pipe_.st[pipe_.import ? 0 : 1];
+    u64 off = 0;
+    if (pipe_.import && !f->dir && (f->sfd = open(f->src, O_RDONLY)) < 0)
+        pipe_error(f, "open");
+    for (;;) {
+        u64 t = now_ns();
+        struct pchunk *c = pchunk_new(f, off);
+        int n = 0;
+        if (!f->dir && f->sfd >= 0 && !f->failed) {
+            n = pipe_.import ? read(f->sfd, c->data, PIPE_CHUNK) : myfs_pread(fs, f->sfd, c->data, PIPE_CHUNK, off);
+            if (n < 0) {
+                pipe_error(f, "read");
+                n = 0;
+            }
+        }
+        c->len = n;
+        pipe_account(st, t, n);
+        // The first chunk goes even if empty, so that the file gets created
+        if (!n && off) {
+            free(c->data);
+            free(c);
+            pfile_put(f);
+            break;
+        }
+        pq_push(out, c);
+        off += n;
+        if (!n)
+            break;
+    }
+    if (f->sfd >= 0)
+        pipe_.import ? close(f->sfd) : myfs_close(fs, f->sfd);
+    f->sfd = -1;
+}
+
+// Meta stage of import: create each file in myfs on its first chunk
+static void pipe_meta_import(struct pchunk *c) {
+    struct pfile *f = c->f;
+    u64 t = now_ns();
+    if (!c->off && !f->failed) {
+        if (myfs_mknod(fs, f->dst, T_REG) || (f->dfd = myfs_open(fs, f->dst, O_WRONLY)) < 0)
+            pipe_error(f, "create");
+    }
+    pipe_account(&pipe_.st[1], t, 0);
+}
+
+// Meta stage of extract: create each file or directory on the host and open both ends
+static void pipe_meta_extract(struct pfile *f) {
+    u64 t = now_ns();
+    if (f->dir) {
+        if (mkdir(f->dst, 0755) && access(f->dst, W_OK))
+            pipe_error(f, "mkdir");
+    } else if ((f->sfd = myfs_open(fs, f->src, O_RDONLY)) < 0 ||
+               (f->dfd = open(f->dst, O_CREAT | O_TRUNC | O_WRONLY, 0644)) < 0)
+        pipe_error(f, "open");
+    pipe_account(&pipe_.st[0], t, 0);
+}
+
+// Write stage: put the chunk where it belongs in the destination
+static void pipe_write(struct pchunk *c) {
+    struct pfile *f = c->f;
+    u64 t = now_ns();
+    if (c->len && !__atomic_load_n(&f->failed, __ATOMIC_RELAXED) && f->dfd >= 0) {
+        int n = pipe_.import ? myfs_pwrite(fs, f->dfd, c->data, c->len, c->off)
+                             : pwrite(f->dfd, c->data, c->len, c->off);
+        if (n != c->len)
+            pipe_error(f, "write");
+    }
+    pipe_account(&pipe_.st[2], t, c->len);
+    free(c->data);
+    free(c);
+    pfile_put(f);
+}
+
+static void *pipe_worker0(void *arg) {
+    void *item;
+    while ((item = pq_pop(&pipe_.q[0]))) {
+        if (pipe_.import) {
+            pipe_read(item, &pipe_.q[1]);
+            pfile_put(item);
+        } else {
+            pipe_meta_extract(item);
+            pq_push(&pipe_.q[1], item);
+        }
+    }
+    pq_done(&pipe_.q[1]);
+    return 0;
+}
+
+static void *pipe_worker1(void *arg) {
+    void *item;
+    while ((item = pq_pop(&pipe_.q[1]))) {
+        if (pipe_.import) {
+            pipe_meta_import(item);
+            pq_push(&pipe_.q[2], item);
+        } else {
+            pipe_read(item, &pipe_.q[2]);
+            pfile_put(item);
+        }
+    }
+    pq_done(&pipe_.q[2]);
+    return 0;
+}
+
+static void *pipe_worker2(void *arg) {
+    void *item;
+    while ((item = pq_pop(&pipe_.q[2])))
+        pipe_write(item);
+    return 0;
+}
+
+static int import_walk(const char *path, const struct stat *sb, int type, struct FTW *ftw) {
+    char dst[PATH_MAX];
+    if (type != FTW_D && !(type == FTW_F && S_ISREG(sb->st_mode)))
+        return 0;
+    snprintf(dst, sizeof dst, "%s%s", pipe_.dst, path + strlen(pipe_.src));
+    if (type == FTW_D) {
+        // Here rather than in the meta stage: see above. The root may exist already.
+        u64 t = now_ns();
+        int fd;
+        if (myfs_mknod(fs, dst, T_DIR) && ((fd = myfs_open(fs, dst, O_RDONLY)) < 0 || myfs_close(fs, fd))) {
+            fprintf(stderr, "%s -> %s: mkdir failed\n", path, dst);
+            __atomic_fetch_add(&pipe_.errors, 1, __ATOMIC_RELAXED);
+        }
+        pipe_account(&pipe_.st[1], t, 0);
+        return 0;
+    }
+    pq_push(&pipe_.q[0], pfile_new(path, dst, 0));
+    return 0;
+}
+
+// Queue the myfs directory 'src' and everything in it, in preorder
+static void extract_walk(const char *src, const char *dst) {
+    struct dirent des[NDIRENTS_PER_BLOCK];
+    struct filestat sts[NDIRENTS_PER_BLOCK];
+    char s[PATH_MAX], d[PATH_MAX];
+    int fd, n;
+    pq_push(&pipe_.q[0], pfile_new(src, dst, 1));
+    if ((fd = myfs_open(fs, (char *)src, O_RDONLY)) < 0) {
+        fprintf(stderr, "%s not found in myfs\n", src);
+        __atomic_fetch_add(&pipe_.errors, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    while ((n = myfs_readdir(fs, fd, des, NDIRENTS_PER_BLOCK, sts)) > 0)
+        for (int i = 0; i < n; i++) {
+            snprintf(s, sizeof s, "%s/%s", strcmp(src, "/") ? src : "", des[i].name);
+            snprintf(d, sizeof d, "%s/%s", dst, des[i].name);
+            if (sts[i].type == T_DIR)
+                extract_walk(s, d);
+            else if (sts[i].type == T_REG)
+                pq_push(&pipe_.q[0], pfile_new(s, d, 0));
+        }
+    myfs_close(fs, fd);
+}
+
+static void cmd_pipeline(int import, char *src, char *dst, int nthreads) {
+    pthread_t tids[3][PIPE_MAXTHREADS];
+    int nt[3] = { import ? nthreads : 1, import ? 1 : nthreads, nthreads };
+    static const char *names[2][3] = { { "meta", "read", "write" }, { "read", "meta", "write" } };
+    if (nthreads < 1 || nthreads > PIPE_MAXTHREADS) {
+        fprintf(stdout, "%s: 1 to %d threads\n", import ? "import" : "extract", PIPE_MAXTHREADS);
+        return;
+    }
+    memset(&pipe_, 0, sizeof pipe_);
+    pipe_.import = import;
+    pipe_.src = src;
+    pipe_.dst = dst;
+    pq_init(&pipe_.q[0], 1);
+    for (int i = 0; i < 3; i++) {
+        if (i)
+            pq_init(&pipe_.q[i], nt[i - 1]);
+        pipe_.st[i] = (struct pstage){ .name = names[import][i], .nthreads = nt[i] };
+    }
+    u64 begin = now_ns();
+    void *(*workers[3])(void *) = { pipe_worker0, pipe_worker1, pipe_worker2 };
+    for (int i = 0; i < 3; i++)
+        for (int j = 0; j < nt[i]; j++)
+            assert(!pthread_create(&tids[i][j], 0, workers[i], 0));
+    if (import) {
+        if (nftw(src, import_walk, 16, FTW_PHYS)) {
+            perror(src);
+            __atomic_fetch_add(&pipe_.errors, 1, __ATOMIC_RELAXED);
+        }
+    } else
+        extract_walk(src, dst);
+    pq_done(&pipe_.q[0]);
+    for (int i = 0; i < 3; i++)
+        for (int j = 0; j < nt[i]; j++)
+            assert(!pthread_join(tids[i][j], 0));
+    for (int i = 0; i < 3; i++)
+        pq_destroy(&pipe_.q[i]);
+    double secs = (now_ns() - begin) / 1e9;
+    printf("%s:%llu\nerrors:%d\nsecs:%.6f\n", import ? "imported" : "extracted", pipe_.nfiles, pipe_.errors, secs);
+    // Throughput of each stage while working, and how busy its threads were
+    for (int i = 0; i < 3; i++) {
+        struct pstage *st = &pipe_.st[i];
+        double busy = st->busy / 1e9;
+        printf("%s:%d threads %llu items %.2f MB %.1f MB/s %.0f%% busy\n", st->name, st->nthreads, st->items,
+               st->bytes / 1e6, busy ? st->bytes / 1e6 / (busy / st->nthreads) : 0, 100 * busy / st->nthreads / secs);
+    }
 }
 
 #define CMDLEN 32
 int main(int argc, char *argv[]) 
 {
-    if (argc < 2) {
-        fprintf(stderr, "usage: test <vhd_path>\n");
+    int rdonly = argc > 2 && !strcmp(argv[1], "-r");
+    if (argc < 2 + rdonly) {
+        fprintf(stderr, "usage: test [-r] <vhd_path>\n");
         exit(1);
     }
-    fs_init(argv[1]);
+    if (!(fs = rdonly ? myfs_mount_rdonly(argv[2], "log") : myfs_mount(argv[1], "log")))
+        exit(1);
     for (;;) {
         char cmd[CMDLEN];
         // printf("> "), fflush(stdout);
@@ -206,19 +1019,28 @@ int main(int argc, char *argv[])
             continue;
         if (!strncmp(args[0], "ls", 2)) {
             if (cnt < 2)
-                fprintf(stdout, "usage: ls <path>\n");
-            else
-                cmd_ls(args[1]);
+                fprintf(stdout, "usage: ls [-l] <path>\n");
+            else if (!strcmp(args[1], "-l")) {
+                if (cnt < 3)
+                    fprintf(stdout, "usage: ls [-l] <path>\n");
+                else
+                    cmd_ls(args[2], 1);
+            } else
+                cmd_ls(args[1], 0);
         } else if (!strncmp(args[0], "mkdir", 5)) {
             if (cnt < 2)
                 fprintf(stdout, "usage: mkdir <path>\n");
             else
                 cmd_mkdir(args[1]);
         } else if (!strncmp(args[0], "migrate", 7)) {
-            if (cnt < 3)
-                fprintf(stdout, "usage: migrate <myfs_path> <host_path>\n");
+            if (cnt < 3 || ((!strcmp(args[1], "-z") || !strcmp(args[1], "-c")) && cnt < 4))
+                fprintf(stdout, "usage: migrate [-z|-c] <myfs_path> <host_path>\n");
+            else if (!strcmp(args[1], "-z"))
+                cmd_migrate(args[2], args[3], I_COMPRESSED);
+            else if (!strcmp(args[1], "-c"))
+                cmd_migrate(args[2], args[3], I_CONTIG);
             else
-                cmd_migrate(args[1], args[2]);
+                cmd_migrate(args[1], args[2], 0);
         } else if (!strncmp(args[0], "retrieve", 8)) {
             if (cnt < 3)
                 fprintf(stdout, "usage: retrieve <host_path> <myfs_path>\n");
@@ -228,12 +1050,12 @@ int main(int argc, char *argv[])
             if (cnt < 4)
                 fprintf(stdout, "read: read <path> <off> <size>\n");
             else
-                cmd_read(args[1], atoi(args[2]), atoi(args[3]));
-        } if (!strncmp(args[0], "write", 5)) {
+                cmd_read(args[1], strtoull(args[2], 0, 10), atoi(args[3]));
+        } if (!strcmp(args[0], "write")) {
             if (cnt < 5)
                 fprintf(stdout, "write: write <path> <off> <size> <words>\n");
             else
-                cmd_write(args[1], atoi(args[2]), atoi(args[3]), args[4]);
+                cmd_write(args[1], strtoull(args[2], 0, 10), atoi(args[3]), args[4]);
         } if (!strncmp(args[0], "stat", 4)) {
             if (cnt < 2)
                 fprintf(stdout, "stat: stat <path>\n");
@@ -244,7 +1066,124 @@ int main(int argc, char *argv[])
                 fprintf(stdout, "touch: touch <path>\n");
             else
                 cmd_touch(args[1]);
-        } else if (!strncmp(args[0], "quit", 4))
+        } else if (!strcmp(args[0], "rm")) {
+            if (cnt < 2)
+                fprintf(stdout, "rm: rm <path>\n");
+            else
+                cmd_rm(args[1]);
+        } else if (!strcmp(args[0], "snapshot") || !strcmp(args[0], "snapdel") ||
+                   !strcmp(args[0], "rollback")) {
+            if (cnt < 2)
+                fprintf(stdout, "%s: %s <name>\n", args[0], args[0]);
+            else
+                cmd_snapshot(args[0], args[1]);
+        } else if (!strcmp(args[0], "open")) {
+            if (cnt < 2)
+                fprintf(stdout, "open: open <path>\n");
+            else
+                cmd_open(args[1]);
+        } else if (!strcmp(args[0], "dup") || !strcmp(args[0], "close")) {
+            if (cnt < 2)
+                fprintf(stdout, "%s: %s <fd>\n", args[0], args[0]);
+            else if (!strcmp(args[0], "dup"))
+                cmd_dup(atoi(args[1]));
+            else
+                cmd_close(atoi(args[1]));
+        } else if (!strcmp(args[0], "fdread") || !strcmp(args[0], "fdwrite")) {
+            if (cnt < 3)
+                fprintf(stdout, "%s: %s <fd> %s\n", args[0], args[0], args[0][2] == 'r' ? "<size>" : "<words>");
+            else if (args[0][2] == 'r')
+                cmd_fdread(atoi(args[1]), 0, atoi(args[2]), 0);
+            else
+                cmd_fdwrite(atoi(args[1]), 0, args[2], 0);
+        } else if (!strcmp(args[0], "fdpread") || !strcmp(args[0], "fdpwrite")) {
+            if (cnt < 4)
+                fprintf(stdout, "%s: %s <fd> <off> %s\n", args[0], args[0], args[0][3] == 'r' ? "<size>" : "<words>");
+            else if (args[0][3] == 'r')
+                cmd_fdread(atoi(args[1]), strtoull(args[2], 0, 10), atoi(args[3]), 1);
+            else
+                cmd_fdwrite(atoi(args[1]), strtoull(args[2], 0, 10), args[3], 1);
+        } else if (!strcmp(args[0], "clone")) {
+            if (cnt < 3)
+                fprintf(stdout, "clone: clone <dst_path> <src_path>\n");
+            else
+                cmd_clone(args[1], args[2]);
+        } else if (!strcmp(args[0], "defrag")) {
+            cmd_defrag(cnt > 1 && !strcmp(args[1], "-p"));
+        } else if (!strcmp(args[0], "dedup")) {
+            if (cnt < 2 || (strcmp(args[1], "on") && strcmp(args[1], "off")))
+                fprintf(stdout, "dedup: dedup on|off\n");
+            else
+                cmd_dedup(args[1]);
+        } else if (!strcmp(args[0], "direct")) {
+            if (cnt < 2 || (strcmp(args[1], "on") && strcmp(args[1], "off")))
+                fprintf(stdout, "direct: direct on|off\n");
+            else
+                cmd_direct(args[1]);
+        } else if (!strcmp(args[0], "import") || !strcmp(args[0], "extract")) {
+            if (cnt < 4)
+                fprintf(stdout, "%s\n", !strcmp(args[0], "import") ? "import: import <myfs_dir> <host_dir> <nthreads>"
+                                                                     : "extract: extract <host_dir> <myfs_dir> <nthreads>");
+            else if (!strcmp(args[0], "import"))
+                cmd_pipeline(1, args[2], args[1], atoi(args[3]));
+            else
+                cmd_pipeline(0, args[2], args[1], atoi(args[3]));
+        } else if (!strcmp(args[0], "iostat")) {
+            cmd_iostat();
+        } else if (!strcmp(args[0], "record")) {
+            if (cnt < 2)
+                fprintf(stdout, "record: record <host_path>|off\n");
+            else
+                cmd_record(args[1]);
+        } else if (!strcmp(args[0], "replay")) {
+            if (cnt < 2)
+                fprintf(stdout, "replay: replay <host_path>\n");
+            else
+                cmd_replay(args[1]);
+        } else if (!strcmp(args[0], "sync")) {
+            if (myfs_sync(fs))
+                fprintf(stderr, "sync failed\n");
+        } else if (!strcmp(args[0], "fsync")) {
+            if (cnt < 2)
+                fprintf(stdout, "fsync: fsync <path>\n");
+            else
+                cmd_fsync(args[1]);
+        } else if (!strcmp(args[0], "writeback")) {
+            if (cnt < 3)
+                fprintf(stdout, "writeback: writeback <age_ms> <dirty_ratio>\n");
+            else
+                fs_writeback(fs, strtoul(args[1], 0, 10), strtoul(args[2], 0, 10));
+        } else if (!strcmp(args[0], "stress")) {
+            if (cnt < 3)
+                fprintf(stdout, "stress: stress <nthreads> <nops>\n");
+            else
+                cmd_stress(atoi(args[1]), atoi(args[2]));
+        } else if (!strcmp(args[0], "scrub")) {
+            cmd_scrub();
+        } else if (!strcmp(args[0], "gen")) {
+            printf("gen:%u\n", fs_generation(fs));
+        } else if (!strcmp(args[0], "export")) {
+            if (cnt < 3)
+                fprintf(stdout, "export: export <host_path> <since_gen>\n");
+            else
+                cmd_export(args[1], strtoul(args[2], 0, 10));
+        } else if (!strcmp(args[0], "apply")) {
+            if (cnt < 3)
+                fprintf(stdout, "apply: apply <vhd_path> <host_path>\n");
+            else
+                cmd_apply(args[1], args[2]);
+        } else if (!strcmp(args[0], "extent")) {
+            if (cnt < 2)
+                fprintf(stdout, "extent: extent <path>\n");
+            else
+                cmd_extent(args[1]);
+        } else if (!strcmp(args[0], "df")) {
+            cmd_df();
+        } else if (!strcmp(args[0], "snapshots")) {
+            cmd_snapshots();
+        } else if (!strncmp(args[0], "quit", 4)) {
+            myfs_unmount(fs);
             exit(0);
+        }
     }
 }